@@ -30,6 +30,8 @@ It's written for use with httpd, but doesn't need to be used as such.
 #define os_malloc malloc
 #define os_free free
 #define os_memcpy memcpy
+#define os_memcmp memcmp
+#define os_strlen strlen
 #define os_strncmp strncmp
 #define os_strcmp strcmp
 #define os_strcpy strcpy
@@ -40,10 +42,21 @@ It's written for use with httpd, but doesn't need to be used as such.
 #include "espfsformat.h"
 #include "espfs.h"
 
+#ifdef ESPFS_HEATSHRINK
+#include "heatshrink_config_custom.h"
+#include "heatshrink_decoder.h"
+//Bytes of compressed data fed to the decoder at a time
+#define HEATSHRINK_INPUT_LEN 16
+#endif
+
 static char* espFsData = NULL;
+// directory of a version 2 image, NULL for version 1
+static EspFsDirEntry *espFsDir = NULL;
+static int espFsDirCount;
 
 struct EspFsFile {
 	EspFsHeader *header;
+	EspFsHeader *data; // header of the file with the data, differs from header for aliases
 	char decompressor;
 	int32_t posDecomp;
 	char *posStart;
@@ -51,6 +64,11 @@ struct EspFsFile {
 	void *decompData;
 };
 
+//The file handles, a free one has a NULL header. Opening and closing files doesn't touch the
+//heap, the files served by httpd get opened and closed for every request.
+static EspFsFile espFsHandles[ESPFS_MAX_HANDLES];
+EspFsStats espFsStats;
+
 /*
 Available locations, at least in my flash, with boundaries partially guessed. This
 is using 0.9.1/0.9.2 SDK on a not-too-new module.
@@ -67,16 +85,98 @@ Accessing the flash through the mem emulation at 0x40200000 is a bit hairy: All
 a memory exception, crashing the program.
 */
 
+#ifdef ESPFS_PARTITION
+//Images in the espfs partition lie past the first MB of flash, which is all that's mapped into
+//memory. They're addressed by their flash offset instead, reads of those go through spi_flash_read.
+#define ESPFS_IN_PARTITION(p) ((uint32_t)(p) < 0x1000000)
+
+static void ICACHE_FLASH_ATTR flashRead(char *dst, uint32_t addr, int len) {
+	uint32_t w[64];
+	while (len>0) {
+		int b=addr&3, n;
+		if (b==0 && ((uint32_t)dst&3)==0 && len>=4) {
+			//both aligned, straight into dst
+			n=len&~3;
+			spi_flash_read(addr, (uint32 *)dst, n);
+		} else {
+			n=b+len;
+			if (n>sizeof(w)) n=sizeof(w);
+			spi_flash_read(addr-b, w, (n+3)&~3);
+			n-=b;
+			os_memcpy(dst, (char *)w+b, n);
+		}
+		dst+=n;
+		addr+=n;
+		len-=n;
+	}
+}
+#endif
+
+//Copies len bytes over from src to dst, but does it using *only* aligned 32-bit reads. The
+//bytes up to the first word boundary of src are extracted from their word one by one, the
+//middle moves a word at a time (unrolled if dst is aligned too) and the tail comes out of
+//one last word. The test build uses it too with ESPFS_BENCH, so espfstest can time it.
+#if defined(__ets__) || defined(ESPFS_BENCH)
+void ICACHE_FLASH_ATTR memcpyAligned(char *dst, char *src, int len) {
+	uint32_t w;
+#ifdef ESPFS_PARTITION
+	if (ESPFS_IN_PARTITION(src)) {
+		flashRead(dst, (uint32_t)src, len);
+		return;
+	}
+#endif
+	int b=((uintptr_t)src&3);
+	if (b!=0 && len>0) {
+		w=*((uint32_t *)(src-b))>>(8*b);
+		for (; b<4 && len>0; b++, len--) {
+			*dst++=w;
+			w>>=8;
+			src++;
+		}
+	}
+	if (((uintptr_t)dst&3)==0) {
+		uint32_t *d=(uint32_t *)dst, *s=(uint32_t *)src;
+		for (; len>=16; len-=16, d+=4, s+=4) {
+			d[0]=s[0]; d[1]=s[1]; d[2]=s[2]; d[3]=s[3];
+		}
+		for (; len>=4; len-=4) *d++=*s++;
+		dst=(char *)d;
+		src=(char *)s;
+	} else {
+		for (; len>=4; len-=4, dst+=4, src+=4) {
+			w=*((uint32_t *)src);
+			dst[0]=w; dst[1]=w>>8; dst[2]=w>>16; dst[3]=w>>24;
+		}
+	}
+	if (len>0) {
+		w=*((uint32_t *)src);
+		for (; len>0; len--) {
+			*dst++=w;
+			w>>=8;
+		}
+	}
+}
+#else
+#define memcpyAligned memcpy
+#endif
+
 EspFsInitResult ICACHE_FLASH_ATTR espFsInit(void *flashAddress) {
-	// base address must be aligned to 4 bytes
-	if (((int)flashAddress & 3) != 0) {
+	// base address must be aligned to 4 bytes, it's a flash offset for an image in the
+	// espfs partition
+	if (((uintptr_t)flashAddress & 3) != 0) {
 		return ESPFS_INIT_RESULT_BAD_ALIGN;
 	}
 
 	// check if there is valid header at address
 	EspFsHeader testHeader;
-	os_memcpy(&testHeader, flashAddress, sizeof(EspFsHeader));
-	if (testHeader.magic != ESPFS_MAGIC) {
+	memcpyAligned((char*)&testHeader, (char*)flashAddress, sizeof(EspFsHeader));
+	if (testHeader.magic == ESPFS_MAGIC_V2) {
+		EspFsDirHeader *dh = (EspFsDirHeader *)&testHeader;
+		espFsDir = (EspFsDirEntry *)((char *)flashAddress+sizeof(EspFsDirHeader));
+		espFsDirCount = dh->count;
+	} else if (testHeader.magic == ESPFS_MAGIC) {
+		espFsDir = NULL;
+	} else {
 		return ESPFS_INIT_RESULT_NO_IMAGE;
 	}
 
@@ -84,27 +184,64 @@ EspFsInitResult ICACHE_FLASH_ATTR espFsInit(void *flashAddress) {
 	return ESPFS_INIT_RESULT_OK;
 }
 
-//Copies len bytes over from dst to src, but does it using *only*
-//aligned 32-bit reads. Yes, it's no too optimized but it's short and sweet and it works.
+//Checks the image at flashAddress, len bytes long, without mounting it: the file headers have to
+//follow each other inside the image up to the last one, aliases have to point back at one of
+//them and so do the directory entries of a version 2 image, which have to be sorted too.
+EspFsInitResult ICACHE_FLASH_ATTR espFsCheck(void *flashAddress, int len) {
+	if (((uintptr_t)flashAddress & 3) != 0) {
+		return ESPFS_INIT_RESULT_BAD_ALIGN;
+	}
 
-//ToDo: perhaps os_memcpy also does unaligned accesses?
-#ifdef __ets__
-void ICACHE_FLASH_ATTR memcpyAligned(char *dst, char *src, int len) {
-	int x;
-	int w, b;
-	for (x=0; x<len; x++) {
-		b=((int)src&3);
-		w=*((int *)(src-b));
-		if (b==0) *dst=(w>>0);
-		if (b==1) *dst=(w>>8);
-		if (b==2) *dst=(w>>16);
-		if (b==3) *dst=(w>>24);
-		dst++; src++;
+	char *img=(char *)flashAddress;
+	EspFsHeader h;
+	int pos=0, first, files=0, dirCount=0;
+	if (len<(int)sizeof(EspFsHeader)) return ESPFS_INIT_RESULT_NO_IMAGE;
+	memcpyAligned((char*)&h, img, sizeof(EspFsHeader));
+	if (h.magic==ESPFS_MAGIC_V2) {
+		dirCount=((EspFsDirHeader *)&h)->count;
+		if (dirCount<0 || dirCount>(len-(int)sizeof(EspFsDirHeader))/(int)sizeof(EspFsDirEntry))
+			return ESPFS_INIT_RESULT_NO_IMAGE;
+		pos=sizeof(EspFsDirHeader)+dirCount*sizeof(EspFsDirEntry);
+	} else if (h.magic!=ESPFS_MAGIC) {
+		return ESPFS_INIT_RESULT_NO_IMAGE;
 	}
+	first=pos;
+
+	//Walk the file headers
+	while (1) {
+		if (pos+(int)sizeof(EspFsHeader)>len) return ESPFS_INIT_RESULT_NO_IMAGE;
+		memcpyAligned((char*)&h, img+pos, sizeof(EspFsHeader));
+		if (h.magic!=ESPFS_MAGIC) return ESPFS_INIT_RESULT_NO_IMAGE;
+		if (h.flags&FLAG_LASTFILE) break;
+		int left=len-pos-sizeof(EspFsHeader);
+		if (h.nameLen<0 || h.fileLenComp<0 || h.nameLen>left || h.fileLenComp>left-h.nameLen)
+			return ESPFS_INIT_RESULT_NO_IMAGE;
+		if (h.flags&FLAG_ALIAS) {
+			int32_t back;
+			if (h.fileLenComp<4) return ESPFS_INIT_RESULT_NO_IMAGE;
+			memcpyAligned((char*)&back, img+pos+sizeof(EspFsHeader)+h.nameLen, 4);
+			if (back<=0 || back>pos-first || (back&3)) return ESPFS_INIT_RESULT_NO_IMAGE;
+		}
+		pos+=sizeof(EspFsHeader)+h.nameLen+h.fileLenComp;
+		pos=(pos+3)&~3;
+		files++;
+	}
+
+	//Every file has its directory entry
+	if (first>0 && dirCount!=files) return ESPFS_INIT_RESULT_NO_IMAGE;
+	uint32_t hash=0;
+	for (int i=0; i<dirCount; i++) {
+		EspFsDirEntry e;
+		memcpyAligned((char*)&e, img+sizeof(EspFsDirHeader)+i*sizeof(EspFsDirEntry),
+				sizeof(EspFsDirEntry));
+		if (e.hash<hash || e.offset<first || e.offset>=pos || (e.offset&3))
+			return ESPFS_INIT_RESULT_NO_IMAGE;
+		hash=e.hash;
+		memcpyAligned((char*)&h, img+e.offset, sizeof(EspFsHeader));
+		if (h.magic!=ESPFS_MAGIC || (h.flags&FLAG_LASTFILE)) return ESPFS_INIT_RESULT_NO_IMAGE;
+	}
+	return ESPFS_INIT_RESULT_OK;
 }
-#else
-#define memcpyAligned memcpy
-#endif
 
 // Returns flags of opened file.
 int ICACHE_FLASH_ATTR espFsFlags(EspFsFile *fh) {
@@ -120,8 +257,138 @@ int ICACHE_FLASH_ATTR espFsFlags(EspFsFile *fh) {
 	return (int)flags;
 }
 
-//Open a file and return a pointer to the file desc struct.
-EspFsFile ICACHE_FLASH_ATTR *espFsOpen(char *fileName) {
+// Returns the number of bytes espFsRead will return for the opened file.
+int ICACHE_FLASH_ATTR espFsSize(EspFsFile *fh) {
+	if (fh == NULL) return -1;
+	int32_t len;
+	// gzipped files are stored without espfs compression and served as they are
+	if (fh->decompressor == COMPRESS_NONE)
+		memcpyAligned((char*)&len, (char*)&fh->data->fileLenComp, 4);
+	else
+		memcpyAligned((char*)&len, (char*)&fh->data->fileLenDecomp, 4);
+	return len;
+}
+
+// Gets the content hash of the opened file stored by mkespfsimage. Returns 0 if the image
+// doesn't have one for the file.
+int ICACHE_FLASH_ATTR espFsHash(EspFsFile *fh, uint32_t *hash) {
+	if (fh == NULL || !(espFsFlags(fh) & FLAG_HASH)) return 0;
+	int16_t nameLen;
+	memcpyAligned((char*)&nameLen, (char*)&fh->header->nameLen, 2);
+	memcpyAligned((char*)hash, (char*)fh->header+sizeof(EspFsHeader)+nameLen-4, 4);
+	return 1;
+}
+
+// Gets the response head mkespfsimage rendered for the opened file. Copies it into buff if it
+// fits into len bytes and returns its length, returns 0 if the image doesn't have one.
+int ICACHE_FLASH_ATTR espFsHead(EspFsFile *fh, char *buff, int len) {
+	if (fh == NULL || !(espFsFlags(fh) & FLAG_HEAD)) return 0;
+	int16_t nameLen;
+	int32_t headLen;
+	memcpyAligned((char*)&nameLen, (char*)&fh->header->nameLen, 2);
+	char *p = (char*)fh->header+sizeof(EspFsHeader)+nameLen-8;
+	memcpyAligned((char*)&headLen, p, 4);
+	if (headLen <= len) memcpyAligned(buff, p-((headLen+3)&~3), headLen);
+	return headLen;
+}
+
+//Set up a file desc struct for the file whose header is at hpos
+static EspFsFile ICACHE_FLASH_ATTR *espFsOpenAt(char *hpos, EspFsOpenResult *result) {
+	EspFsHeader h;
+	EspFsFile *r;
+	char *dpos=hpos;
+	memcpyAligned((char*)&h, hpos, sizeof(EspFsHeader));
+	if (h.flags&FLAG_ALIAS) {
+		//Same data as an earlier file, go to that one for it
+		int32_t back;
+		memcpyAligned((char*)&back, hpos+sizeof(EspFsHeader)+h.nameLen, 4);
+		dpos=hpos-back;
+		memcpyAligned((char*)&h, dpos, sizeof(EspFsHeader));
+		if (h.magic!=ESPFS_MAGIC || (h.flags&FLAG_ALIAS)) {
+#ifdef ESPFS_DBG
+			os_printf("Bad alias. EspFS image broken.\n");
+#endif
+			*result=ESPFS_OPEN_RESULT_ERROR;
+			return NULL;
+		}
+	}
+	if (h.compression!=COMPRESS_NONE
+#ifdef ESPFS_HEATSHRINK
+			&& h.compression!=COMPRESS_HEATSHRINK
+#endif
+			) {
+#ifdef ESPFS_DBG
+		os_printf("Invalid compression: %d\n", h.compression);
+#endif
+		*result=ESPFS_OPEN_RESULT_ERROR;
+		return NULL;
+	}
+	for (r=espFsHandles; r<espFsHandles+ESPFS_MAX_HANDLES && r->header!=NULL; r++) ;
+	if (r==espFsHandles+ESPFS_MAX_HANDLES) {
+#ifdef ESPFS_DBG
+		os_printf("Out of file handles\n");
+#endif
+		espFsStats.exhausted++;
+		*result=ESPFS_OPEN_RESULT_NO_HANDLE;
+		return NULL;
+	}
+	r->data=(EspFsHeader *)dpos;
+	r->decompressor=h.compression;
+	r->posComp=dpos+sizeof(EspFsHeader)+h.nameLen; //Skip to content.
+	r->posStart=r->posComp;
+	r->posDecomp=0;
+	r->decompData=NULL;
+#ifdef ESPFS_HEATSHRINK
+	if (h.compression==COMPRESS_HEATSHRINK) {
+		//The first byte of the data has the window and lookahead sizes the file was encoded
+		//with, the window is what the decoder allocates per open file
+		char parm;
+		memcpyAligned(&parm, r->posComp, 1);
+		r->posComp++;
+		r->decompData=heatshrink_decoder_alloc(HEATSHRINK_INPUT_LEN, (parm>>4)&0xf, parm&0xf);
+		if (r->decompData==NULL) {
+			*result=ESPFS_OPEN_RESULT_ERROR;
+			return NULL;
+		}
+	}
+#endif
+	r->header=(EspFsHeader *)hpos; //Takes the handle
+	if (++espFsStats.open>espFsStats.maxOpen) espFsStats.maxOpen=espFsStats.open;
+	*result=ESPFS_OPEN_RESULT_OK;
+	return r;
+}
+
+//Find a file in the directory of a version 2 image: binary search for the first entry with
+//the hash of the name, then check the names of the entries with that hash.
+static EspFsFile ICACHE_FLASH_ATTR *espFsOpenDir(char *fileName, EspFsOpenResult *result) {
+	char namebuf[256];
+	EspFsDirEntry e;
+	int len=os_strlen(fileName)+1;
+	if (len>sizeof(namebuf)) return NULL;
+
+	uint32_t hash=2166136261u; // FNV-1a, as computed by mkespfsimage
+	for (int i=0; i<len-1; i++) hash=(hash^(uint8_t)fileName[i])*16777619u;
+
+	int lo=0, hi=espFsDirCount;
+	while (lo<hi) {
+		int mid=(lo+hi)/2;
+		memcpyAligned((char*)&e, (char*)&espFsDir[mid], sizeof(EspFsDirEntry));
+		if (e.hash<hash) lo=mid+1;
+		else hi=mid;
+	}
+	for (; lo<espFsDirCount; lo++) {
+		memcpyAligned((char*)&e, (char*)&espFsDir[lo], sizeof(EspFsDirEntry));
+		if (e.hash!=hash) break;
+		char *hpos=espFsData+e.offset;
+		memcpyAligned(namebuf, hpos+sizeof(EspFsHeader), len);
+		if (os_memcmp(namebuf, fileName, len)==0) return espFsOpenAt(hpos, result);
+	}
+	return NULL;
+}
+
+//Open a file and return a pointer to the file desc struct. If that fails, *result says why.
+EspFsFile ICACHE_FLASH_ATTR *espFsOpenStatus(char *fileName, EspFsOpenResult *result) {
+	*result=ESPFS_OPEN_RESULT_NOT_FOUND;
 	if (espFsData == NULL) {
 #ifdef ESPFS_DBG
 		os_printf("Call espFsInit first!\n");
@@ -132,18 +399,19 @@ EspFsFile ICACHE_FLASH_ATTR *espFsOpen(char *fileName) {
 	char *hpos;
 	char namebuf[256];
 	EspFsHeader h;
-	EspFsFile *r;
 	//Strip initial slashes
 	while(fileName[0]=='/') fileName++;
-	//Go find that file!
+	if (espFsDir!=NULL) return espFsOpenDir(fileName, result);
+	//Version 1 image, go find that file!
 	while(1) {
 		hpos=p;
 		//Grab the next file header.
-		os_memcpy(&h, p, sizeof(EspFsHeader));
+		memcpyAligned((char*)&h, p, sizeof(EspFsHeader));
 		if (h.magic!=ESPFS_MAGIC) {
 #ifdef ESPFS_DBG
 			os_printf("Magic mismatch. EspFS image broken.\n");
 #endif
+			*result=ESPFS_OPEN_RESULT_ERROR;
 			return NULL;
 		}
 		if (h.flags&FLAG_LASTFILE) {
@@ -152,43 +420,32 @@ EspFsFile ICACHE_FLASH_ATTR *espFsOpen(char *fileName) {
 		}
 		//Grab the name of the file.
 		p+=sizeof(EspFsHeader);
-		os_memcpy(namebuf, p, sizeof(namebuf));
+		memcpyAligned(namebuf, p, sizeof(namebuf));
 //		os_printf("Found file '%s'. Namelen=%x fileLenComp=%x, compr=%d flags=%d\n",
 //				namebuf, (unsigned int)h.nameLen, (unsigned int)h.fileLenComp, h.compression, h.flags);
 		if (os_strcmp(namebuf, fileName)==0) {
 			//Yay, this is the file we need!
-			p+=h.nameLen; //Skip to content.
-			r=(EspFsFile *)os_malloc(sizeof(EspFsFile)); //Alloc file desc mem
-			//os_printf("Alloc %p[%d]\n", r, sizeof(EspFsFile));
-			if (r==NULL) return NULL;
-			r->header=(EspFsHeader *)hpos;
-			r->decompressor=h.compression;
-			r->posComp=p;
-			r->posStart=p;
-			r->posDecomp=0;
-			if (h.compression==COMPRESS_NONE) {
-				r->decompData=NULL;
-			} else {
-#ifdef ESPFS_DBG
-				os_printf("Invalid compression: %d\n", h.compression);
-#endif
-				return NULL;
-			}
-			return r;
+			return espFsOpenAt(hpos, result);
 		}
 		//We don't need this file. Skip name and file
 		p+=h.nameLen+h.fileLenComp;
-		if ((int)p&3) p+=4-((int)p&3); //align to next 32bit val
+		if ((uintptr_t)p&3) p+=4-((uintptr_t)p&3); //align to next 32bit val
 	}
 }
 
+//Open a file and return a pointer to the file desc struct.
+EspFsFile ICACHE_FLASH_ATTR *espFsOpen(char *fileName) {
+	EspFsOpenResult result;
+	return espFsOpenStatus(fileName, &result);
+}
+
 //Read len bytes from the given file into buff. Returns the actual amount of bytes read.
 int ICACHE_FLASH_ATTR espFsRead(EspFsFile *fh, char *buff, int len) {
 	int flen, fdlen;
 	if (fh==NULL) return 0;
 	//Cache file length.
-	memcpyAligned((char*)&flen, (char*)&fh->header->fileLenComp, 4);
-	memcpyAligned((char*)&fdlen, (char*)&fh->header->fileLenDecomp, 4);
+	memcpyAligned((char*)&flen, (char*)&fh->data->fileLenComp, 4);
+	memcpyAligned((char*)&fdlen, (char*)&fh->data->fileLenDecomp, 4);
 	//Do stuff depending on the way the file is compressed.
 	if (fh->decompressor==COMPRESS_NONE) {
 		int toRead;
@@ -200,15 +457,72 @@ int ICACHE_FLASH_ATTR espFsRead(EspFsFile *fh, char *buff, int len) {
 		fh->posComp+=len;
 //		os_printf("Done reading %d bytes, pos=%x\n", len, fh->posComp);
 		return len;
+#ifdef ESPFS_HEATSHRINK
+	} else if (fh->decompressor==COMPRESS_HEATSHRINK) {
+		heatshrink_decoder *dec=(heatshrink_decoder *)fh->decompData;
+		char ebuff[HEATSHRINK_INPUT_LEN];
+		size_t rlen;
+		int decoded=0;
+		if (len>fdlen-fh->posDecomp) len=fdlen-fh->posDecomp;
+		while (decoded<len) {
+			//Take what the decoder has ready, then feed it more compressed data
+			heatshrink_decoder_poll(dec, (uint8_t *)buff+decoded, len-decoded, &rlen);
+			decoded+=rlen;
+			if (decoded==len) break;
+			int elen=flen-(fh->posComp-fh->posStart);
+			if (elen<=0) break;
+			if (elen>HEATSHRINK_INPUT_LEN) elen=HEATSHRINK_INPUT_LEN;
+			memcpyAligned(ebuff, fh->posComp, elen);
+			heatshrink_decoder_sink(dec, (uint8_t *)ebuff, elen, &rlen);
+			if (rlen==0) break; //shouldn't happen, the poll emptied the input buffer
+			fh->posComp+=rlen;
+		}
+		fh->posDecomp+=decoded;
+		return decoded;
+#endif
 	}
 	return 0;
 }
 
+//Move the read position to pos bytes into what espFsRead returns for the file. Stored files just
+//move the pointer without reading anything, heatshrink ones get decompressed up to pos, from the
+//start if going back. Returns the new position.
+int ICACHE_FLASH_ATTR espFsSeek(EspFsFile *fh, int pos) {
+	if (fh==NULL) return -1;
+	int size=espFsSize(fh);
+	if (pos>size) pos=size;
+	if (pos<0) pos=0;
+	if (fh->decompressor==COMPRESS_NONE) {
+		fh->posComp=fh->posStart+pos;
+		fh->posDecomp=pos;
+#ifdef ESPFS_HEATSHRINK
+	} else if (fh->decompressor==COMPRESS_HEATSHRINK) {
+		char buff[64];
+		if (pos<fh->posDecomp) {
+			heatshrink_decoder_reset((heatshrink_decoder *)fh->decompData);
+			fh->posComp=fh->posStart+1; //past the parameter byte
+			fh->posDecomp=0;
+		}
+		while (fh->posDecomp<pos) {
+			int n=pos-fh->posDecomp;
+			if (n>sizeof(buff)) n=sizeof(buff);
+			if (espFsRead(fh, buff, n)==0) break;
+		}
+#endif
+	}
+	return fh->posDecomp;
+}
+
 //Close the file.
 void ICACHE_FLASH_ATTR espFsClose(EspFsFile *fh) {
-	if (fh==NULL) return;
-	//os_printf("Freed %p\n", fh);
-	os_free(fh);
+	if (fh==NULL || fh->header==NULL) return;
+#ifdef ESPFS_HEATSHRINK
+	if (fh->decompressor==COMPRESS_HEATSHRINK) {
+		heatshrink_decoder_free((heatshrink_decoder *)fh->decompData);
+	}
+#endif
+	fh->header=NULL;
+	espFsStats.open--;
 }
 
 
@@ -1,18 +1,46 @@
 #ifndef ESPFS_H
 #define ESPFS_H
 
+#include <stdint.h>
+
 typedef enum {
 	ESPFS_INIT_RESULT_OK,
 	ESPFS_INIT_RESULT_NO_IMAGE,
 	ESPFS_INIT_RESULT_BAD_ALIGN,
 } EspFsInitResult;
 
+typedef enum {
+	ESPFS_OPEN_RESULT_OK,
+	ESPFS_OPEN_RESULT_NOT_FOUND,
+	ESPFS_OPEN_RESULT_NO_HANDLE,  // all ESPFS_MAX_HANDLES handles are in use
+	ESPFS_OPEN_RESULT_ERROR,      // broken image, unsupported compression or out of memory
+} EspFsOpenResult;
+
 typedef struct EspFsFile EspFsFile;
 
+//Number of files that can be open at the same time, the handles are allocated statically
+#ifndef ESPFS_MAX_HANDLES
+#define ESPFS_MAX_HANDLES 8
+#endif
+
+//File handle pool counters
+typedef struct {
+	uint16_t open;      // handles in use
+	uint16_t maxOpen;   // high-watermark of open
+	uint32_t exhausted; // opens that failed because all handles were in use
+} EspFsStats;
+extern EspFsStats espFsStats;
+
 EspFsInitResult espFsInit(void *flashAddress);
+EspFsInitResult espFsCheck(void *flashAddress, int len);
 EspFsFile *espFsOpen(char *fileName);
+EspFsFile *espFsOpenStatus(char *fileName, EspFsOpenResult *result);
 int espFsFlags(EspFsFile *fh);
+int espFsSize(EspFsFile *fh);
+int espFsHash(EspFsFile *fh, uint32_t *hash);
+int espFsHead(EspFsFile *fh, char *buff, int len);
 int espFsRead(EspFsFile *fh, char *buff, int len);
+int espFsSeek(EspFsFile *fh, int pos);
 void espFsClose(EspFsFile *fh);
 
 
@@ -0,0 +1,270 @@
+/*
+Benchmark for espfs.c on the host: times opening files, reading stored files and decompressing
+heatshrink ones in espfs images, so changes to the image format or the copy code can be compared
+with numbers before they go on a module. It can also generate synthetic file trees to build images
+of a given number of files and size from, see the bench target in the Makefile.
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+
+#include "espfs.h"
+#include "espfsformat.h"
+
+//Same as the send buffer httpd reads static files into
+#define READ_LEN 2920
+//Files kept track of per image
+#define MAX_FILES 4096
+
+char *espFsData;
+
+typedef struct {
+	char *name;
+	int flags;
+	int compression;
+} BenchFile;
+
+BenchFile files[MAX_FILES];
+int fileCount;
+double minTime=0.2;
+
+//The byte at a time copy memcpyAligned used to do, as the baseline for the read numbers
+void memcpyBytewise(char *dst, char *src, int len) {
+	int x;
+	int w, b;
+	for (x=0; x<len; x++) {
+		b=((int)(long)src&3);
+		w=*((int *)(src-b));
+		if (b==0) *dst=(w>>0);
+		if (b==1) *dst=(w>>8);
+		if (b==2) *dst=(w>>16);
+		if (b==3) *dst=(w>>24);
+		dst++; src++;
+	}
+}
+
+uint64_t nowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000000ull+ts.tv_nsec;
+}
+
+//Walk the headers of the image to find the names of the files in it
+void listFiles(char *image) {
+	char *p=image;
+	EspFsHeader h;
+	fileCount=0;
+	memcpy(&h, p, sizeof(EspFsHeader));
+	if (h.magic==ESPFS_MAGIC_V2) {
+		EspFsDirHeader dh;
+		memcpy(&dh, p, sizeof(EspFsDirHeader));
+		p+=sizeof(EspFsDirHeader)+dh.count*sizeof(EspFsDirEntry);
+	}
+	while (1) {
+		memcpy(&h, p, sizeof(EspFsHeader));
+		if (h.magic!=ESPFS_MAGIC || (h.flags&FLAG_LASTFILE)) break;
+		if (fileCount<MAX_FILES) {
+			files[fileCount].name=p+sizeof(EspFsHeader);
+			files[fileCount].flags=h.flags;
+			files[fileCount].compression=h.compression;
+			fileCount++;
+		}
+		p+=sizeof(EspFsHeader)+h.nameLen+h.fileLenComp;
+		if ((long)p&3) p+=4-((long)p&3);
+	}
+}
+
+//Time opening and closing all files, or names that aren't in the image, until minTime has
+//passed. Returns ns per open.
+double benchOpen(int missing) {
+	char names[64][300];
+	long opens=0;
+	int n=fileCount<64 ? fileCount : 64;
+	for (int i=0; i<n; i++) sprintf(names[i], "%s.missing", files[i].name);
+	uint64_t t=nowNs(), el;
+	do {
+		for (int i=0; i<fileCount; i++) {
+			EspFsFile *ef=espFsOpen(missing ? names[i%n] : files[i].name);
+			if (ef==NULL && !missing) {
+				fprintf(stderr, "Couldn't open %s\n", files[i].name);
+				exit(1);
+			}
+			espFsClose(ef);
+		}
+		opens+=fileCount;
+		el=nowNs()-t;
+	} while (el<minTime*1e9);
+	return (double)el/opens;
+}
+
+//Time reading the files with the given compression in READ_LEN chunks like httpd does, until
+//minTime has passed. Returns MB/s and the bytes per round in *bytes, 0 if there are no such files.
+double benchRead(int compression, long *bytes) {
+	static char buff[READ_LEN];
+	long total=0, round=0;
+	int len;
+	uint64_t t=nowNs(), el;
+	do {
+		round=0;
+		for (int i=0; i<fileCount; i++) {
+			if (files[i].compression!=compression) continue;
+			EspFsFile *ef=espFsOpen(files[i].name);
+			while ((len=espFsRead(ef, buff, sizeof(buff)))!=0) round+=len;
+			espFsClose(ef);
+		}
+		total+=round;
+		el=nowNs()-t;
+	} while (round>0 && el<minTime*1e9);
+	*bytes=round;
+	return round>0 ? total/(el/1e9)/1e6 : 0;
+}
+
+//The byte-wise copy of as many bytes as benchRead(COMPRESS_NONE) reads, from the start of the image
+double benchBytewise(long bytes, long imageLen) {
+	static char buff[READ_LEN];
+	long total=0;
+	uint64_t t=nowNs(), el;
+	if (bytes>imageLen-4) bytes=imageLen-4;
+	if (bytes<=0) return 0;
+	do {
+		for (long off=0; off<bytes; off+=sizeof(buff)) {
+			memcpyBytewise(buff, espFsData+off, bytes-off<sizeof(buff) ? bytes-off : sizeof(buff));
+		}
+		total+=bytes;
+		el=nowNs()-t;
+	} while (el<minTime*1e9);
+	return total/(el/1e9)/1e6;
+}
+
+void bench(char *imageName, int json) {
+	int f=open(imageName, O_RDONLY);
+	if (f<0) {
+		perror(imageName);
+		exit(1);
+	}
+	off_t size=lseek(f, 0, SEEK_END);
+	espFsData=mmap(NULL, size, PROT_READ, MAP_SHARED, f, 0);
+	close(f);
+	if (espFsData==MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	if (espFsInit(espFsData)!=ESPFS_INIT_RESULT_OK) {
+		fprintf(stderr, "%s: not an espfs image\n", imageName);
+		exit(1);
+	}
+	listFiles(espFsData);
+	int version=(*(int32_t *)espFsData==ESPFS_MAGIC_V2) ? 2 : 1;
+
+	long readBytes;
+#ifdef ESPFS_HEATSHRINK
+	long hsBytes;
+#endif
+	double openNs=benchOpen(0);
+	double missNs=benchOpen(1);
+	double readMBps=benchRead(COMPRESS_NONE, &readBytes);
+#ifdef ESPFS_HEATSHRINK
+	double hsMBps=benchRead(COMPRESS_HEATSHRINK, &hsBytes);
+#endif
+	double byteMBps=benchBytewise(readBytes, size);
+
+	if (json) {
+		printf("{\"image\": \"%s\", \"version\": %d, \"files\": %d, \"imageBytes\": %ld, "
+				"\"openNs\": %.1f, \"missNs\": %.1f, \"readBytes\": %ld, \"readMBps\": %.1f, ",
+				imageName, version, fileCount, (long)size, openNs, missNs, readBytes, readMBps);
+#ifdef ESPFS_HEATSHRINK
+		printf("\"heatshrinkBytes\": %ld, \"heatshrinkMBps\": %.1f, ", hsBytes, hsMBps);
+#endif
+		printf("\"bytewiseMBps\": %.1f}\n", byteMBps);
+	} else {
+		printf("%s,%d,%d,%ld,%.1f,%.1f,%ld,%.1f,",
+				imageName, version, fileCount, (long)size, openNs, missNs, readBytes, readMBps);
+#ifdef ESPFS_HEATSHRINK
+		printf("%ld,%.1f,", hsBytes, hsMBps);
+#endif
+		printf("%.1f\n", byteMBps);
+	}
+	fflush(stdout);
+	munmap(espFsData, size);
+}
+
+//Write count files of size bytes into dir. Three quarters are text that compresses about as
+//well as the web pages do, as .html, .css and .js; the rest are .png with random bytes.
+void generate(char *dir, int count, int size) {
+	static const char *words[]={"div", "class", "span", "function", "return", "var", "color",
+			"margin", "{", "}", "<", ">", "=", ";", "0px", "width", "height", "this", "if", "else"};
+	static const char *ext[]={"html", "css", "js", "png"};
+	char name[1024];
+	uint32_t seed=1;
+	mkdir(dir, 0755);
+	for (int i=0; i<count; i++) {
+		sprintf(name, "%s/f%05d.%s", dir, i, ext[i&3]);
+		FILE *f=fopen(name, "wb");
+		if (f==NULL) {
+			perror(name);
+			exit(1);
+		}
+		for (int len=0; len<size; ) {
+			seed=seed*1103515245+12345;
+			if ((i&3)==3) {
+				fputc(seed>>16, f);
+				len++;
+			} else {
+				const char *w=words[(seed>>16)%(sizeof(words)/sizeof(words[0]))];
+				int l=strlen(w);
+				if (l+1>size-len) l=size-len-1;
+				fwrite(w, 1, l, f);
+				fputc(' ', f);
+				len+=l+1;
+			}
+		}
+		fclose(f);
+	}
+}
+
+int main(int argc, char **argv) {
+	int json=0;
+	int x;
+
+	if (argc==5 && strcmp(argv[1], "-g")==0) {
+		generate(argv[2], atoi(argv[3]), atoi(argv[4]));
+		exit(0);
+	}
+	for (x=1; x<argc && argv[x][0]=='-'; x++) {
+		if (strcmp(argv[x], "-j")==0) {
+			json=1;
+		} else if (strcmp(argv[x], "-t")==0 && x+1<argc) {
+			minTime=atoi(argv[++x])/1000.0;
+		} else {
+			x=argc;
+		}
+	}
+	if (x>=argc) {
+		printf("Usage: %s [-j] [-t ms] espfs-image...\n"
+				"Times espFsOpen of the files and of missing names (ns per open), espFsRead of\n"
+				"the stored files and, if built with heatshrink, of the heatshrink compressed ones\n"
+				"(MB/s) and the byte-wise copy memcpyAligned replaced, for each image. Each number\n"
+				"is measured for at least ms milliseconds (default 200). Prints CSV, or a JSON\n"
+				"object per image with -j.\n"
+				"       %s -g dir count size\n"
+				"Writes count synthetic files of size bytes into dir.\n", argv[0], argv[0]);
+		exit(0);
+	}
+	if (!json) {
+		printf("image,version,files,imageBytes,openNs,missNs,readBytes,readMBps,");
+#ifdef ESPFS_HEATSHRINK
+		printf("heatshrinkBytes,heatshrinkMBps,");
+#endif
+		printf("bytewiseMBps\n");
+	}
+	for (; x<argc; x++) bench(argv[x], json);
+	return 0;
+}
@@ -12,14 +12,31 @@ when trying to do a <4byte or unaligned read.
 The idea 'borrows' from cpio: it's basically a concatenation of {header, filename, file} data.
 Header, filename and file data is 32-bit aligned. The last file is indicated by data-less header
 with the FLAG_LASTFILE flag set.
+
+Version 2 images start with a directory so files can be found without walking all the headers:
+an EspFsDirHeader, then one EspFsDirEntry per file sorted by the FNV-1a hash of the file name
+(without leading slash), then the version 1 layout. The entries point at the file headers,
+which still hold the name to check against, the lengths and the flags.
 */
 
 
 #define FLAG_LASTFILE (1<<0)
 #define FLAG_GZIP (1<<1)
+//The name area holds a 32-bit FNV-1a hash of the stored file data in its last 4 bytes,
+//after the zero-terminated and padded name. It's served as the ETag of the file.
+#define FLAG_HASH (1<<2)
+//The name area also holds the pre-rendered HTTP response head for the file: the status line
+//and headers up to but excluding the Connection header and the blank line. It follows the
+//name, padded to 32 bits, and is followed by its length as a 32-bit value and the hash.
+#define FLAG_HEAD (1<<3)
+//The file has the same data as a file earlier in the image and stores no copy of it. Its data is
+//a 32-bit offset back from its header to the header of that file, which has the lengths and the
+//data. The name area is its own, so the head has the content type for its own name.
+#define FLAG_ALIAS (1<<4)
 #define COMPRESS_NONE 0
 #define COMPRESS_HEATSHRINK 1
 #define ESPFS_MAGIC 0x73665345
+#define ESPFS_MAGIC_V2 0x32665345
 
 typedef struct {
 	int32_t magic;
@@ -30,4 +47,14 @@ typedef struct {
 	int32_t fileLenDecomp;
 } __attribute__((packed)) EspFsHeader;
 
+typedef struct {
+	int32_t magic;
+	int32_t count;
+} __attribute__((packed)) EspFsDirHeader;
+
+typedef struct {
+	uint32_t hash;
+	uint32_t offset;  // of the EspFsHeader, from the start of the image
+} __attribute__((packed)) EspFsDirEntry;
+
 #endif
\ No newline at end of file
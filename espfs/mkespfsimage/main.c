@@ -6,6 +6,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef __MINGW32__
+#include <pthread.h>
+#endif
 #include "espfs.h"
 #ifdef __MINGW32__
 #include "mman-win32/mman.h"
@@ -19,6 +22,10 @@
 #endif
 #include "espfsformat.h"
 
+#ifdef ESPFS_HEATSHRINK
+#include "heatshrink_encoder.h"
+#endif
+
 //Gzip
 #ifdef ESPFS_GZIP
 // If compiler complains about missing header, try running "sudo apt-get install zlib1g-dev" 
@@ -45,6 +52,56 @@ int htoxl(int in) {
 	return *((int *)r);
 }
 
+#ifdef ESPFS_HEATSHRINK
+//Compress with heatshrink, the first output byte has the window and lookahead sizes for the
+//decoder. The window is what the decoder allocates per open file, so the levels stay small.
+size_t compressHeatshrink(char *in, int insize, char *out, int outcap, int level) {
+	char *outp=out;
+	size_t len;
+	int ws[]={5, 6, 8, 9, 10};
+	int ls[]={3, 3, 4, 4, 4};
+	HSE_poll_res pres;
+	if (level==-1) level=5;
+	level=(level-1)/2; //level is now 0, 1, 2, 3, 4
+	heatshrink_encoder *enc=heatshrink_encoder_alloc(ws[level], ls[level]);
+	if (enc==NULL) {
+		perror("allocating mem for heatshrink");
+		exit(1);
+	}
+	*outp++=(ws[level]<<4)|ls[level];
+	outcap--;
+
+	//Feed the input and drain the output as we go, then flush the rest
+	while (insize>0) {
+		if (heatshrink_encoder_sink(enc, (uint8_t *)in, insize, &len)!=HSER_SINK_OK) {
+			fprintf(stderr, "Heatshrink: sink failed\n");
+			exit(1);
+		}
+		in+=len;
+		insize-=len;
+		do {
+			pres=heatshrink_encoder_poll(enc, (uint8_t *)outp, outcap, &len);
+			outp+=len;
+			outcap-=len;
+		} while (pres==HSER_POLL_MORE);
+	}
+	while (heatshrink_encoder_finish(enc)==HSER_FINISH_MORE) {
+		do {
+			pres=heatshrink_encoder_poll(enc, (uint8_t *)outp, outcap, &len);
+			outp+=len;
+			outcap-=len;
+		} while (pres==HSER_POLL_MORE);
+		if (outcap<=0) {
+			fprintf(stderr, "Heatshrink: output buffer too small\n");
+			exit(1);
+		}
+	}
+
+	heatshrink_encoder_free(enc);
+	return outp-out;
+}
+#endif
+
 #ifdef ESPFS_GZIP
 size_t compressGzip(char *in, int insize, char *out, int outsize, int level) {
 	z_stream stream;
@@ -130,69 +187,250 @@ int parseGzipExtensions(char *input) {
 }
 #endif
 
-int handleFile(int f, char *name, int compression, int level, char **compName, off_t *csizePtr) {
-	char *fdat, *cdat;
-	off_t size, csize;
-	EspFsHeader h;
-	int nameLen;
-	int8_t flags = 0;
-	size=lseek(f, 0, SEEK_END);
-	fdat=mmap(NULL, size, PROT_READ, MAP_SHARED, f, 0);
-	if (fdat==MAP_FAILED) {
+//FNV-1a hash of the stored file data, used as ETag by the web server, and of the file names
+//for the directory
+uint32_t hashData(char *data, off_t len) {
+	uint32_t h=2166136261u;
+	for (off_t i=0; i<len; i++) h=(h^(uint8_t)data[i])*16777619u;
+	return h;
+}
+
+//The file records are collected in memory, the directory in front of them can only be
+//written once all files are known
+char *image=NULL;
+size_t imageLen=0, imageSize=0;
+EspFsDirEntry *dir=NULL;
+int dirLen=0, dirSize=0;
+
+void emit(const void *data, size_t len) {
+	if (imageLen+len>imageSize) {
+		imageSize=(imageLen+len)*2;
+		image=realloc(image, imageSize);
+		if (image==NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	memcpy(image+imageLen, data, len);
+	imageLen+=len;
+}
+
+void addDirEntry(char *name) {
+	if (dirLen==dirSize) {
+		dirSize=dirSize ? dirSize*2 : 32;
+		dir=realloc(dir, dirSize*sizeof(EspFsDirEntry));
+		if (dir==NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	dir[dirLen].hash=hashData(name, strlen(name));
+	dir[dirLen].offset=imageLen;
+	dirLen++;
+}
+
+int compareDirEntries(const void *a, const void *b) {
+	uint32_t ha=((EspFsDirEntry *)a)->hash, hb=((EspFsDirEntry *)b)->hash;
+	//Break ties on the offset so the image doesn't depend on the qsort implementation
+	if (ha==hb) {
+		ha=((EspFsDirEntry *)a)->offset;
+		hb=((EspFsDirEntry *)b)->offset;
+	}
+	return ha<hb ? -1 : ha>hb;
+}
+
+//The mappings from file extensions to mime types, keep in sync with the ones in httpd.c
+static const struct {
+	const char *ext;
+	const char *mimetype;
+} mimeTypes[]={
+	{"htm", "text/htm"},
+	{"html", "text/html; charset=UTF-8"},
+	{"css", "text/css"},
+	{"js", "text/javascript"},
+	{"txt", "text/plain"},
+	{"jpg", "image/jpeg"},
+	{"jpeg", "image/jpeg"},
+	{"png", "image/png"},
+	{"tpl", "text/html; charset=UTF-8"},
+	{NULL, "text/html"}, //default value
+};
+
+const char *getMimetype(char *name) {
+	int i=0;
+	char *ext=name+strlen(name);
+	while (ext!=name && *ext!='.') ext--;
+	if (*ext=='.') ext++;
+	while (mimeTypes[i].ext!=NULL && strcmp(ext, mimeTypes[i].ext)!=0) i++;
+	return mimeTypes[i].mimetype;
+}
+
+//Render the response head the web server sends for the file, the same headers cgiEspFsHook
+//would produce minus the Connection header the server adds. Returns the length.
+int renderHead(char *buff, char *name, off_t size, int flags, uint32_t hash) {
+	return sprintf(buff, "HTTP/1.1 200 OK\r\nServer: esp-link\r\n"
+			"Content-Type: %s\r\nContent-Length: %u\r\nAccept-Ranges: bytes\r\n%s"
+			"Cache-Control: max-age=3600, must-revalidate\r\nETag: \"%08x\"\r\n",
+			getMimetype(name), (unsigned int)size,
+			(flags & FLAG_GZIP) ? "Content-Encoding: gzip\r\n" : "", hash);
+}
+
+//A file going into the image. The compression of all the files runs on a pool of worker
+//threads, then the files get written to the image one after the other.
+typedef struct FileJob {
+	char *path;       // as given on stdin
+	char *name;       // in the image
+	char *fdat;       // mapped file, NULL if it couldn't be read
+	off_t size;
+	char *cdat;       // data to store
+	off_t csize;
+	int compression;
+	int8_t flags;
+	uint32_t hash;    // of the stored data
+	size_t offset;    // of the header in the image
+	struct FileJob *aliasOf; // earlier file with the same data
+} FileJob;
+
+FileJob *jobs=NULL;
+int numJobs=0, nextJob=0;
+int compType=COMPRESS_NONE;
+int compLvl=-1;
+#ifndef __MINGW32__
+pthread_mutex_t jobLock=PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+void compressFile(FileJob *j) {
+	int f=open(j->path, O_RDONLY);
+	if (f<0) {
+		perror(j->path);
+		return;
+	}
+	j->size=lseek(f, 0, SEEK_END);
+	j->fdat=mmap(NULL, j->size, PROT_READ, MAP_SHARED, f, 0);
+	close(f);
+	if (j->fdat==MAP_FAILED) {
 		perror("mmap");
-		return 0;
+		j->fdat=NULL;
+		return;
 	}
 
+	j->compression=compType;
+	j->flags=0;
 #ifdef ESPFS_GZIP
-	if (shouldCompressGzip(name)) {
-		csize = size*3;
-		if (csize<100) // gzip has some headers that do not fit when trying to compress small files
-			csize = 100; // enlarge buffer if this is the case
-		cdat=malloc(csize);
-		csize=compressGzip(fdat, size, cdat, csize, level);
-		compression = COMPRESS_NONE;
-		flags = FLAG_GZIP;
+	if (shouldCompressGzip(j->name)) {
+		j->csize = j->size*3;
+		if (j->csize<100) // gzip has some headers that do not fit when trying to compress small files
+			j->csize = 100; // enlarge buffer if this is the case
+		j->cdat=malloc(j->csize);
+		j->csize=compressGzip(j->fdat, j->size, j->cdat, j->csize, compLvl);
+		j->compression = COMPRESS_NONE;
+		j->flags = FLAG_GZIP;
 	} else
 #endif
-	if (compression==COMPRESS_NONE) {
-		csize=size;
-		cdat=fdat;
+	if (j->compression==COMPRESS_NONE) {
+		j->csize=j->size;
+		j->cdat=j->fdat;
+#ifdef ESPFS_HEATSHRINK
+	} else if (j->compression==COMPRESS_HEATSHRINK) {
+		j->csize=j->size*2+16; //worst case is 9 bits per byte plus the parameter byte
+		j->cdat=malloc(j->csize);
+		j->csize=compressHeatshrink(j->fdat, j->size, j->cdat, j->csize, compLvl);
+#endif
 	} else {
-		fprintf(stderr, "Unknown compression - %d\n", compression);
+		fprintf(stderr, "Unknown compression - %d\n", j->compression);
 		exit(1);
 	}
 
-	if (csize>size) {
+	if (j->csize>j->size) {
 		//Compressing enbiggened this file. Revert to uncompressed store.
-		compression=COMPRESS_NONE;
-		csize=size;
-		cdat=fdat;
-		flags=0;
+		j->compression=COMPRESS_NONE;
+		j->csize=j->size;
+		j->cdat=j->fdat;
+		j->flags=0;
 	}
+	j->hash=hashData(j->cdat, j->csize);
+}
+
+//Worker thread: compress files until there are none left
+void *compressWorker(void *arg) {
+	while (1) {
+#ifndef __MINGW32__
+		pthread_mutex_lock(&jobLock);
+#endif
+		int n=nextJob++;
+#ifndef __MINGW32__
+		pthread_mutex_unlock(&jobLock);
+#endif
+		if (n>=numJobs) return NULL;
+		compressFile(&jobs[n]);
+	}
+}
+
+//Find a file already in the image that stores exactly the same data the same way
+FileJob *findDuplicate(FileJob *j) {
+	for (FileJob *o=jobs; o<j; o++) {
+		if (o->fdat==NULL || o->aliasOf!=NULL) continue;
+		if (o->hash==j->hash && o->csize==j->csize && o->size==j->size &&
+				o->compression==j->compression && o->flags==j->flags &&
+				memcmp(o->cdat, j->cdat, j->csize)==0) return o;
+	}
+	return NULL;
+}
+
+//Add a compressed file to the image, returns the compression rate
+int writeFile(FileJob *j, char **compName) {
+	EspFsHeader h;
+	int nameLen, headLen;
+	char head[512];
+	char *name=j->name;
+	uint32_t hash=j->hash;
+
+	//heatshrink gets decompressed on the fly, gzip is served as is
+	headLen=renderHead(head, name, j->compression==COMPRESS_NONE ? j->csize : j->size, j->flags, hash);
+	j->aliasOf=findDuplicate(j);
+	j->offset=imageLen;
 
 	//Fill header data
 	h.magic=('E'<<0)+('S'<<8)+('f'<<16)+('s'<<24);
-	h.flags=flags;
-	h.compression=compression;
+	h.flags=j->flags|FLAG_HASH|FLAG_HEAD;
+	if (j->aliasOf!=NULL) h.flags|=FLAG_ALIAS;
+	h.compression=j->compression;
 	h.nameLen=nameLen=strlen(name)+1;
 	if (h.nameLen&3) h.nameLen+=4-(h.nameLen&3); //Round to next 32bit boundary
+	h.nameLen+=(headLen+3)&~3; //Room for the response head
+	h.nameLen+=8; //Room for the head length and the hash
 	h.nameLen=htoxs(h.nameLen);
-	h.fileLenComp=htoxl(csize);
-	h.fileLenDecomp=htoxl(size);
+	if (j->aliasOf!=NULL) {
+		//Only store the way back to the data, see FLAG_ALIAS
+		h.fileLenComp=htoxl(4);
+		h.fileLenDecomp=htoxl(4);
+	} else {
+		h.fileLenComp=htoxl(j->csize);
+		h.fileLenDecomp=htoxl(j->size);
+	}
 
-	write(1, &h, sizeof(EspFsHeader));
-	write(1, name, nameLen);
+	addDirEntry(name);
+	emit(&h, sizeof(EspFsHeader));
+	emit(name, nameLen);
 	while (nameLen&3) {
-		write(1, "\000", 1);
+		emit("\000", 1);
 		nameLen++;
 	}
-	write(1, cdat, csize);
-	//Pad out to 32bit boundary
-	while (csize&3) {
-		write(1, "\000", 1);
-		csize++;
+	int word=htoxl(headLen);
+	while (headLen&3) head[headLen++]=0;
+	emit(head, headLen);
+	emit(&word, 4);
+	word=htoxl(hash);
+	emit(&word, 4);
+	if (j->aliasOf!=NULL) {
+		word=htoxl(j->offset-j->aliasOf->offset);
+		emit(&word, 4);
+	} else {
+		emit(j->cdat, j->csize);
+		//Pad out to 32bit boundary
+		static const char zeros[4];
+		if (j->csize&3) emit(zeros, 4-(j->csize&3));
 	}
-	munmap(fdat, size);
 
 	if (compName != NULL) {
 		if (h.compression==COMPRESS_NONE) {
@@ -201,12 +439,17 @@ int handleFile(int f, char *name, int compression, int level, char **compName, o
 			} else {
 				*compName = "none";
 			}
+		} else if (h.compression==COMPRESS_HEATSHRINK) {
+			*compName = "heatshrink";
 		} else {
 			*compName = "unknown";
 		}
 	}
-  *csizePtr = csize;
-	return (csize*100)/size;
+	return (j->csize*100)/j->size;
+}
+
+int compareJobs(const void *a, const void *b) {
+	return strcmp(((FileJob *)a)->name, ((FileJob *)b)->name);
 }
 
 //Write final dummy header with FLAG_LASTFILE set.
@@ -218,21 +461,22 @@ void finishArchive() {
 	h.nameLen=htoxs(0);
 	h.fileLenComp=htoxl(0);
 	h.fileLenDecomp=htoxl(0);
-	write(1, &h, sizeof(EspFsHeader));
+	emit(&h, sizeof(EspFsHeader));
 }
 
 int main(int argc, char **argv) {
-	int f, x;
+	int x;
 	char fileName[1024];
 	char *realName;
 	struct stat statBuf;
 	int serr;
 	int rate;
 	int err=0;
-	int compType;  //default compression type - heatshrink
-	int compLvl=-1;
-
-	compType = COMPRESS_NONE;
+#ifndef __MINGW32__
+	int threads=sysconf(_SC_NPROCESSORS_ONLN);
+#else
+	int threads=1;
+#endif
 
 	for (x=1; x<argc; x++) {
 		if (strcmp(argv[x], "-c")==0 && argc>=x-2) {
@@ -242,6 +486,10 @@ int main(int argc, char **argv) {
 			compLvl=atoi(argv[x+1]);
 			if (compLvl<1 || compLvl>9) err=1;
 			x++;
+		} else if (strcmp(argv[x], "-j")==0 && argc>=x-2) {
+			threads=atoi(argv[x+1]);
+			if (threads<1) err=1;
+			x++;
 #ifdef ESPFS_GZIP
 		} else if (strcmp(argv[x], "-g")==0 && argc>=x-2) {
 			if (!parseGzipExtensions(argv[x+1])) err=1;
@@ -260,17 +508,22 @@ int main(int argc, char **argv) {
 
 	if (err) {
 		fprintf(stderr, "%s - Program to create espfs images\n", argv[0]);
-		fprintf(stderr, "Usage: \nfind | %s [-c compressor] [-l compression_level] ", argv[0]);
+		fprintf(stderr, "Usage: \nfind | %s [-c compressor] [-l compression_level] [-j threads] ", argv[0]);
 #ifdef ESPFS_GZIP
 		fprintf(stderr, "[-g gzipped_extensions] ");
 #endif
 		fprintf(stderr, "> out.espfs\n");
 		fprintf(stderr, "Compressors:\n");
 		fprintf(stderr, "0 - None(default)\n");
+#ifdef ESPFS_HEATSHRINK
+		fprintf(stderr, "1 - Heatshrink, for the files that don't get gzipped\n");
+#endif
 		fprintf(stderr, "\nCompression level: 1 is worst but low RAM usage, higher is better compression \nbut uses more ram on decompression. -1 = compressors default.\n");
 #ifdef ESPFS_GZIP
 		fprintf(stderr, "\nGzipped extensions: list of comma separated, case sensitive file extensions \nthat will be gzipped. Defaults to 'html,css,js'\n");
 #endif
+		fprintf(stderr, "\nThreads: number of files compressed in parallel, defaults to the number of CPUs.\n");
+		fprintf(stderr, "The files are sorted by name, the same files always give the same image.\n");
 		exit(0);
 	}
 
@@ -278,6 +531,7 @@ int main(int argc, char **argv) {
 	setmode(fileno(stdout), _O_BINARY);
 #endif
 
+	int jobsSize=0;
 	while(fgets(fileName, sizeof(fileName), stdin)) {
 		//Kill off '\n' at the end
 		fileName[strlen(fileName)-1]=0;
@@ -288,23 +542,68 @@ int main(int argc, char **argv) {
 			realName=fileName;
 			if (fileName[0]=='.') realName++;
 			if (realName[0]=='/') realName++;
-			f=open(fileName, O_RDONLY);
-			if (f>0) {
-				char *compName = "unknown";
-        off_t csize;
-				rate=handleFile(f, realName, compType, compLvl, &compName, &csize);
-				fprintf(stderr, "%-16s (%3d%%, %s, %4u bytes)\n", realName, rate, compName, (uint32_t)csize);
-				close(f);
-			} else {
-				perror(fileName);
+			if (numJobs==jobsSize) {
+				jobsSize=jobsSize ? jobsSize*2 : 64;
+				jobs=realloc(jobs, jobsSize*sizeof(FileJob));
+				if (jobs==NULL) {
+					perror("realloc");
+					exit(1);
+				}
 			}
+			memset(&jobs[numJobs], 0, sizeof(FileJob));
+			jobs[numJobs].path=strdup(fileName);
+			jobs[numJobs].name=jobs[numJobs].path+(realName-fileName);
+			numJobs++;
 		} else {
 			if (serr!=0) {
 				perror(fileName);
 			}
 		}
 	}
+	//The order of find's output depends on the file system, sort so the image doesn't
+	qsort(jobs, numJobs, sizeof(FileJob), compareJobs);
+
+#ifndef __MINGW32__
+	if (threads>numJobs) threads=numJobs;
+	pthread_t *workers=malloc(threads*sizeof(pthread_t));
+	for (x=0; x<threads; x++) {
+		if (pthread_create(&workers[x], NULL, compressWorker, NULL)!=0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	for (x=0; x<threads; x++) pthread_join(workers[x], NULL);
+#else
+	compressWorker(NULL);
+#endif
+
+	for (x=0; x<numJobs; x++) {
+		if (jobs[x].fdat==NULL) continue;
+		char *compName = "unknown";
+		rate=writeFile(&jobs[x], &compName);
+		if (jobs[x].aliasOf!=NULL) {
+			fprintf(stderr, "%-16s (same as %s, %u bytes saved)\n", jobs[x].name, jobs[x].aliasOf->name,
+					(uint32_t)((jobs[x].csize+3)&~3)-4);
+		} else {
+			fprintf(stderr, "%-16s (%3d%%, %s, %4u bytes)\n", jobs[x].name, rate, compName, (uint32_t)jobs[x].csize);
+		}
+	}
 	finishArchive();
+
+	//Write the directory sorted by name hash, then the files. The offsets in the directory
+	//are from the start of the image.
+	qsort(dir, dirLen, sizeof(EspFsDirEntry), compareDirEntries);
+	EspFsDirHeader dh;
+	int dirBytes=sizeof(EspFsDirHeader)+dirLen*sizeof(EspFsDirEntry);
+	dh.magic=htoxl(ESPFS_MAGIC_V2);
+	dh.count=htoxl(dirLen);
+	write(1, &dh, sizeof(EspFsDirHeader));
+	for (x=0; x<dirLen; x++) {
+		dir[x].hash=htoxl(dir[x].hash);
+		dir[x].offset=htoxl(dir[x].offset+dirBytes);
+	}
+	write(1, dir, dirLen*sizeof(EspFsDirEntry));
+	write(1, image, imageLen);
 	return 0;
 }
 
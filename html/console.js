@@ -1,9 +1,64 @@
+//===== Console text rendering
+
+// The console keeps at most maxLines lines of text in memory and only the lines visible in
+// its scroll window (plus a few above and below) are in the DOM. New text updates or adds a
+// handful of line nodes instead of re-parsing the whole console, so memory and CPU use stay
+// flat on pages that are left open for days.
+var maxLines = 2000;
+var overscan = 10;
+
+function consoleInit(el) {
+  el.lines = [""]; // the last line is the partial one still being received
+  el.textEnd = 0;
+  el.lineHeight = 0;
+  el.innerHTML = "";
+  el.above = el.appendChild(e("div"));
+  el.body = el.appendChild(e("div"));
+  el.below = el.appendChild(e("div"));
+  if (!el.scrollBound) {
+    bnd(el, "scroll", function() { consoleRender(el); });
+    el.scrollBound = true;
+  }
+}
+
+function consoleAppend(el, text) {
+  var atEnd = el.scrollTop + el.clientHeight >= el.scrollHeight - (el.lineHeight || 16);
+  var parts = text.replace(/\r/g, "").split("\n");
+  el.lines[el.lines.length-1] += parts[0];
+  for (var i=1; i<parts.length; i++) el.lines.push(parts[i]);
+
+  // drop the oldest lines, keeping what's on screen in place
+  var drop = el.lines.length - maxLines;
+  if (drop > 0) {
+    el.lines.splice(0, drop);
+    if (!atEnd) el.scrollTop -= drop * (el.lineHeight || 16);
+  }
+
+  consoleRender(el);
+  if (atEnd) el.scrollTop = el.scrollHeight;
+}
+
+function consoleRender(el) {
+  var n = el.lines.length, lh = el.lineHeight || 16;
+  var first = Math.max(0, Math.floor(el.scrollTop / lh) - overscan);
+  var last = Math.min(n, first + Math.ceil((el.clientHeight || 400) / lh) + 2*overscan);
+  el.above.style.height = (first*lh) + "px";
+  el.below.style.height = ((n-last)*lh) + "px";
+
+  var b = el.body;
+  while (b.childNodes.length < last-first) b.appendChild(e("div"));
+  while (b.childNodes.length > last-first) b.removeChild(b.lastChild);
+  for (var i=first; i<last; i++) {
+    var t = el.lines[i] || " ";
+    var c = b.childNodes[i-first];
+    if (c.textContent !== t) c.textContent = t;
+  }
+  if (!el.lineHeight && b.firstChild) el.lineHeight = b.firstChild.offsetHeight;
+}
+
 function fetchText(delay, repeat) {
   var el = $("#console");
-  if (el.textEnd == undefined) {
-    el.textEnd = 0;
-    el.innerHTML = "";
-  }
+  if (el.textEnd == undefined) consoleInit(el);
   window.setTimeout(function() {
     ajaxJson('GET', console_url + "?start=" + el.textEnd,
       function(resp) {
@@ -21,9 +76,9 @@ function updateText(resp) {
   if (resp != null && resp.len > 0) {
     console.log("updateText got", resp.len, "chars at", resp.start);
     if (resp.start > el.textEnd) {
-      el.innerHTML = el.innerHTML.concat("\r\n<missing lines\r\n");
+      consoleAppend(el, "\n<missing lines>\n");
     }
-    el.innerHTML = el.innerHTML.concat(resp.text);
+    consoleAppend(el, resp.text);
     el.textEnd = resp.start + resp.len;
     delay = 500;
   }
@@ -285,6 +285,47 @@ function getWifiInfo() {
       function(s, st) { window.setTimeout(getWifiInfo, 1000); });
 }
 
+//===== EMS state
+
+// the device bumps a version on every change, we only ask for what changed since the last poll
+var emsVersion = 0;
+
+function emsPad(n) { return (n < 10 ? "0" : "") + n; }
+function emsHours(min) { return Math.floor(min/60) + ":" + emsPad(min%60); }
+function emsTemp(v) { return (v/10).toFixed(1) + " &deg;C"; }
+
+var emsFormat = {
+  time: function(v) {
+    return emsPad(Math.floor(v/3600)) + ":" + emsPad(Math.floor(v/60)%60) + ":" + emsPad(v%60);
+  },
+  uptime: emsHours,
+  runtime: emsHours,
+  nextservice: function(v) { return (v*100) + " h"; },
+  heating: function(v) { return v ? "on" : "off"; },
+  outdoortemp: emsTemp,
+  watertemp: emsTemp,
+  flowtemp: emsTemp,
+  boilertemp: emsTemp,
+  wwtemp: emsTemp,
+  pressure: function(v) { return (v/10).toFixed(1) + " bar"; },
+};
+
+function showEmsState(data) {
+  Object.keys(data).forEach(function(v) {
+    var el = $("#ems-" + v);
+    if (el != null) el.innerHTML = emsFormat[v] ? emsFormat[v](data[v]) : data[v];
+  });
+  emsVersion = data.version;
+  $("#ems-spinner").setAttribute("hidden", "");
+  $("#ems-table").removeAttribute("hidden");
+}
+
+function getEmsState() {
+  ajaxJson('GET', "/ems/state?since=" + emsVersion,
+      function(data) { showEmsState(data); window.setTimeout(getEmsState, 5000); },
+      function(s, st) { window.setTimeout(getEmsState, 10000); });
+}
+
 //===== Notifications
 
 function showWarning(text) {
@@ -24,19 +24,94 @@ Esp8266 http server - core routines
 #define MAX_CONN 6
 //Max post buffer len
 #define MAX_POST 1024
-//Max send buffer len
+//Max send buffer len: everything a callback produces goes out in one espconn_sent. It has to
+//stay below lwIP's send buffer of two full segments (TCP_SND_BUF, 2*1460), up to that espconn
+//copies all of it before returning, beyond it espconn keeps a pointer into the buffer and
+//writes the rest later.
 #define MAX_SENDBUFF_LEN 2600
+//Max number of query args and request headers indexed per request
+#define MAX_ARGS 12
+#define MAX_HEADERS 16
+//Room for the headers added to a response by httpdFinishHeaders
+#define HEADER_RESERVE 64
+//Room reserved in front of the send buffer for a chunk header "xxx\r\n" and at its end
+//for the chunk trailer "\r\n" plus the last chunk "0\r\n\r\n"
+#define CHUNK_HDR 5
+#define CHUNK_TRAILER 7
+//Seconds an idle keep-alive connection is kept open
+#define IDLE_TIMEOUT 10
+//Seconds a client gets to send the request head once it has started sending it
+#define HEAD_TIMEOUT 5
+//Seconds of inactivity after which the SDK drops a connection, e.g. a client that doesn't
+//read the response
+#define STALL_TIMEOUT 30
+//Max number of connections waiting for a slot and how many seconds they wait at most
+#define MAX_BACKLOG 4
+#define BACKLOG_TIMEOUT 3
+//Continuations of streaming cgis run in a task at this priority, above it the uart task
+//handling the EMS telegrams
+#define HTTPD_TASK_PRIO 1
+#define HTTPD_TASK_QUEUE_LEN 2
+//Bytes the continuations may produce per run of the task before it yields
+#define HTTPD_TASK_BUDGET (2*MAX_SENDBUFF_LEN)
+//Responses longer than this are bulk transfers and yield to shorter ones
+#define BULK_LEN MAX_SENDBUFF_LEN
 
 
 //This gets set at init time.
 static HttpdBuiltInUrl *builtInUrls;
 
+//The send buffer is shared by all connections, the callbacks filling it don't nest and
+//espconn_sent copies the data out as it's shorter than TCP_SND_BUF. It's too big for the
+//callback stacks anyway.
+static char sendBuff[MAX_SENDBUFF_LEN];
+
+//Route index compiled from builtInUrls at init time: the exact urls sorted by hash and, within
+//the same hash, by table position, plus the wildcard urls in table order. Lookups return the
+//first matching entry at or after a given table position, so the table order (and with it
+//authBasic-style barriers) is preserved.
+typedef struct {
+	uint32_t hash;      // hash of the url (exact routes)
+	uint16_t idx;       // index into builtInUrls
+	uint16_t len;       // length of the prefix before the '*' (wildcard routes)
+} HttpdRoute;
+static HttpdRoute *exactRoutes, *wildRoutes;
+static int numExact, numWild;
+
+//Location of a name=value query arg or a name: value header in the request head
+typedef struct {
+	uint16_t name;      // offset in head of the name
+	uint16_t nameLen;
+	uint16_t value;     // offset in head of the value, args are still url-encoded
+	uint16_t valueLen;
+} HttpdSpan;
+
 //Private data for http connection
 struct HttpdPriv {
 	char head[MAX_HEAD_LEN];
 	int headPos;
+	bool inHead;        // still receiving the request head
+	int lineStart;      // offset in head of the line being received
+	int lineLen;        // bytes received of that line, including those that didn't fit
+	char lineFirst;     // first byte of that line
+	HttpdSpan args[MAX_ARGS];       // index of the query args, built when parsing the url
+	HttpdSpan headers[MAX_HEADERS]; // index of the headers, built as they are parsed
+	uint8_t numArgs, numHeaders;
+	bool argsOverflow;  // more args than MAX_ARGS, use httpdFindArg on getArgs instead
+	bool headersOverflow; // more headers than MAX_HEADERS, scan the head instead
 	char *sendBuff;
+	int sendBuffStart;  // offset in sendBuff of the first byte to transmit
 	int sendBuffLen;
+	int headEnd;        // offset in sendBuff of the blank line ending the response headers, -1 if none
+	bool keepAlive;     // keep the connection open after this response
+	bool http11;        // the request is HTTP/1.1
+	bool chunked;       // the response body is sent in chunked encoding
+	bool respStarted;   // httpdStartResponse has been called for this request
+	bool hasLength;     // the response headers include a Content-Length
+	uint32 lastActive;  // system time of the last data received or sent
+	bool closing;       // timed out or failed, waiting for the disconnect callback
+	bool ready;         // the cgi returned more and its data got sent, waiting for the task
+	int respLen;        // bytes of the response sent so far
 };
 
 //Connection pool
@@ -44,6 +119,24 @@ static HttpdPriv connPrivData[MAX_CONN];
 static HttpdConnData connData[MAX_CONN];
 static HttpdPostData connPostData[MAX_CONN];
 
+//Connections accepted while all slots were busy, oldest first. They're held so they don't
+//receive anything until they get a slot.
+typedef struct {
+	struct espconn *conn;
+	int remote_port;
+	uint8 remote_ip[4];
+	uint32 since;       // system time of the connect
+} HttpdBacklog;
+static HttpdBacklog backlog[MAX_BACKLOG];
+static int backlogLen;
+
+HttpdStats httpdStats;
+static ETSTimer httpdTimer;
+
+static os_event_t httpdTaskQueue[HTTPD_TASK_QUEUE_LEN];
+static bool httpdTaskPosted;
+static int httpdNextConn;  // slot the task looks at first, for round-robin
+
 //Listening connection data
 static struct espconn httpdConn;
 static esp_tcp httpdTcp;
@@ -55,7 +148,7 @@ typedef struct {
 } MimeMap;
 
 //The mappings from file extensions to mime types. If you need an extra mime type,
-//add it here.
+//add it here and to mkespfsimage, which renders the response heads of the espfs files.
 static const MimeMap mimeTypes[]={
 	{"htm", "text/htm"},
 	{"html", "text/html; charset=UTF-8"},
@@ -95,19 +188,35 @@ static void debugConn(void *arg, char *what) {
 	//os_printf("%s %s\n", connStr, what);
 }
 
-//Looks up the connData info for a specific esp connection
+//Checks that the connData belongs to the remote end of the esp connection
+static bool ICACHE_FLASH_ATTR httpdConnMatches(HttpdConnData *conn, struct espconn *espconn) {
+	return conn->remote_port == espconn->proto.tcp->remote_port &&
+			os_memcmp(conn->remote_ip, espconn->proto.tcp->remote_ip, 4) == 0;
+}
+
+//Looks up the connData info for a specific esp connection. The connData is attached to the
+//espconn's reverse pointer at connect time, but the SDK sometimes hands us a different
+//espconn for the same connection, so the pointer is verified and we fall back to matching
+//the remote IP:port.
 static HttpdConnData ICACHE_FLASH_ATTR *httpdFindConnData(void *arg) {
 	struct espconn *espconn = arg;
-	for (int i=0; i<MAX_CONN; i++) {
-		if (connData[i].remote_port == espconn->proto.tcp->remote_port &&
-				os_memcmp(connData[i].remote_ip, espconn->proto.tcp->remote_ip, 4) == 0)
-		{
+	HttpdConnData *conn = espconn->reverse;
+	int i;
+	if (conn != NULL && conn >= connData && conn < connData+MAX_CONN &&
+			conn == &connData[conn - connData] && httpdConnMatches(conn, espconn)) {
+		if (arg != conn->conn) conn->conn = arg;
+		return conn;
+	}
+
+	for (i=0; i<MAX_CONN; i++) {
+		if (httpdConnMatches(&connData[i], espconn)) {
 #if 0
 			os_printf("FindConn: 0x%p->0x%p", arg, &connData[i]);
 			if (arg == connData[i].conn) os_printf("\n");
 			else os_printf(" *** was 0x%p\n", connData[i].conn);
 #endif
 			if (arg != connData[i].conn) connData[i].conn = arg; // yes, this happens!?
+			espconn->reverse = &connData[i];
 			return &connData[i];
 		}
 	}
@@ -119,6 +228,7 @@ static HttpdConnData ICACHE_FLASH_ATTR *httpdFindConnData(void *arg) {
 //Retires a connection for re-use
 static void ICACHE_FLASH_ATTR httpdRetireConn(HttpdConnData *conn) {
 	conn->conn = NULL; // don't try to send anything, the SDK crashes...
+	conn->priv->ready = false;
 	if (conn->cgi != NULL) conn->cgi(conn); // free cgi data
 	if (conn->post->buff != NULL) {
 		os_free(conn->post->buff);
@@ -134,6 +244,38 @@ static void ICACHE_FLASH_ATTR httpdRetireConn(HttpdConnData *conn) {
 			(unsigned long)system_get_free_heap_size());
 }
 
+//Gets a connection ready to receive the next request
+static void ICACHE_FLASH_ATTR httpdResetRequest(HttpdConnData *conn) {
+	if (conn->post->buff != NULL) os_free(conn->post->buff);
+	conn->post->buff=NULL;
+	conn->post->buffLen=0;
+	conn->post->received=0;
+	conn->post->len=-1;
+	conn->post->multipartBoundary=NULL;
+	conn->priv->headPos=0;
+	conn->priv->head[0]=0;
+	conn->priv->inHead=true;
+	conn->priv->lineStart=0;
+	conn->priv->lineLen=0;
+	conn->priv->numArgs=0;
+	conn->priv->numHeaders=0;
+	conn->priv->argsOverflow=false;
+	conn->priv->headersOverflow=false;
+	conn->priv->keepAlive=false;
+	conn->priv->http11=false;
+	conn->priv->chunked=false;
+	conn->priv->respStarted=false;
+	conn->priv->hasLength=false;
+	conn->priv->ready=false;
+	conn->priv->respLen=0;
+	conn->url=NULL;
+	conn->getArgs=NULL;
+	conn->cgi=NULL;
+	conn->cgiData=NULL;
+	conn->startTime = system_get_time();
+	conn->priv->lastActive = conn->startTime;
+}
+
 //Stupid li'l helper function that returns the value of a hex char.
 static int httpdHexVal(char c) {
 	if (c>='0' && c<='9') return c-'0';
@@ -195,15 +337,45 @@ int ICACHE_FLASH_ATTR httpdFindArg(char *line, char *arg, char *buff, int buffLe
 	return -1; //not found
 }
 
-//Get the value of a certain header in the HTTP client head
-int ICACHE_FLASH_ATTR httpdGetHeader(HttpdConnData *conn, char *header, char *ret, int retLen) {
+//Compare the first len chars of two header names, which are case-insensitive
+static bool ICACHE_FLASH_ATTR httpdNameMatch(const char *a, const char *b, int len) {
+	int j=0;
+	while (j<len && (a[j]|0x20)==(b[j]|0x20)) j++;
+	return j==len;
+}
+
+//Find the span whose name matches, names of headers are compared case-insensitively
+static HttpdSpan ICACHE_FLASH_ATTR *httpdFindSpan(char *head, HttpdSpan *spans, int n,
+		const char *name, bool nocase) {
+	int len=os_strlen(name);
+	for (int i=0; i<n; i++) {
+		if (spans[i].nameLen!=len) continue;
+		char *p=head+spans[i].name;
+		if (nocase ? httpdNameMatch(p, name, len) : os_strncmp(p, name, len)==0) return &spans[i];
+	}
+	return NULL;
+}
+
+//Look up a query arg of the request. Like httpdFindArg the value is urldecoded into buff
+//and its length returned, -1 if the arg isn't there, 0 if the request has no args at all.
+int ICACHE_FLASH_ATTR httpdGetArg(HttpdConnData *conn, char *arg, char *buff, int buffLen) {
+	HttpdPriv *priv=conn->priv;
+	if (conn->getArgs==NULL) return 0;
+	if (priv->argsOverflow) return httpdFindArg(conn->getArgs, arg, buff, buffLen);
+	HttpdSpan *a=httpdFindSpan(priv->head, priv->args, priv->numArgs, arg, false);
+	if (a==NULL) return -1;
+	return httpdUrlDecode(priv->head+a->value, a->valueLen, buff, buffLen);
+}
+
+//Scan the HTTP client head for a header, used if there were too many to index
+static int ICACHE_FLASH_ATTR httpdScanHeader(HttpdConnData *conn, char *header, char *ret, int retLen) {
 	char *p=conn->priv->head;
 	p=p+strlen(p)+1; //skip GET/POST part
 	p=p+strlen(p)+1; //skip HTTP part
 	while (p<(conn->priv->head+conn->priv->headPos)) {
 		while(*p<=32 && *p!=0) p++; //skip crap at start
 		//See if this is the header
-		if (os_strncmp(p, header, strlen(header))==0 && p[strlen(header)]==':') {
+		if (httpdNameMatch(p, header, strlen(header)) && p[strlen(header)]==':') {
 			//Skip 'key:' bit of header line
 			p=p+strlen(header)+1;
 			//Skip past spaces after the colon
@@ -223,13 +395,99 @@ int ICACHE_FLASH_ATTR httpdGetHeader(HttpdConnData *conn, char *header, char *re
 	return 0;
 }
 
+//Get the value of a certain header in the HTTP client head
+int ICACHE_FLASH_ATTR httpdGetHeader(HttpdConnData *conn, char *header, char *ret, int retLen) {
+	HttpdPriv *priv=conn->priv;
+	if (priv->headersOverflow) return httpdScanHeader(conn, header, ret, retLen);
+	HttpdSpan *h=httpdFindSpan(priv->head, priv->headers, priv->numHeaders, header, true);
+	if (h==NULL) return 0;
+	int len=h->valueLen;
+	if (len>retLen-1) len=retLen-1;
+	os_memcpy(ret, priv->head+h->value, len);
+	ret[len]=0;
+	return 1;
+}
+
 //Start the response headers.
+//Reason phrase for the status codes the server sends
+static const char ICACHE_FLASH_ATTR *httpdStatusText(int code) {
+	switch (code) {
+	case 200: return "OK";
+	case 206: return "Partial Content";
+	case 302: return "Found";
+	case 304: return "Not Modified";
+	case 400: return "Bad Request";
+	case 401: return "Unauthorized";
+	case 404: return "Not Found";
+	case 416: return "Range Not Satisfiable";
+	case 500: return "Internal Server Error";
+	case 503: return "Service Unavailable";
+	default:  return code < 400 ? "OK" : "ERROR";
+	}
+}
+
 void ICACHE_FLASH_ATTR httpdStartResponse(HttpdConnData *conn, int code) {
 	char buff[128];
 	int l;
-	char *status = code < 400 ? "OK" : "ERROR";
-	l = os_sprintf(buff, "HTTP/1.0 %d %s\r\nServer: esp-link\r\nConnection: close\r\n", code, status);
+	const char *status = httpdStatusText(code);
+	// the Connection header gets added by httpdFinishHeaders once we know whether the
+	// response length is known
+	l = os_sprintf(buff, "HTTP/1.1 %d %s\r\nServer: esp-link\r\n", code, status);
 	httpdSend(conn, buff, l);
+	conn->priv->respStarted = true;
+	conn->priv->hasLength = code == 304; // never has a body
+}
+
+//Start a response with a head rendered ahead of time, like the ones mkespfsimage stores
+//with the files: the status line and headers including a Content-Length, each ending in
+//\r\n. Returns where in the send buffer the len bytes of head go, NULL if there's no room.
+//Finish with httpdEndHeaders as usual.
+char ICACHE_FLASH_ATTR *httpdStartRawResponse(HttpdConnData *conn, int len) {
+	HttpdPriv *priv = conn->priv;
+	if (priv->sendBuffLen+len > MAX_SENDBUFF_LEN-CHUNK_TRAILER-HEADER_RESERVE) return NULL;
+	char *p = priv->sendBuff+priv->sendBuffLen;
+	priv->sendBuffLen += len;
+	priv->respStarted = true;
+	priv->hasLength = true;
+	return p;
+}
+
+//Format the ETag for a content hash into etag (at least 11 chars) and check it against the
+//request's If-None-Match. Returns true if the client's copy is current, in which case the
+//caller should respond with a 304 carrying just the ETag.
+bool ICACHE_FLASH_ATTR httpdETagMatch(HttpdConnData *conn, uint32_t hash, char *etag) {
+	char buff[64];
+	os_sprintf(etag, "\"%08x\"", (unsigned int)hash);
+	return httpdGetHeader(conn, "If-None-Match", buff, sizeof(buff)) &&
+			os_strstr(buff, etag) != NULL;
+}
+
+//Get the range of a "Range: bytes=" request header for a body of size bytes. Returns 1 with the
+//first and last byte in *start and *end, -1 if the range can't be satisfied (respond with a 416
+//and "Content-Range: bytes */size") or 0 to send the whole body: there's no range, several of
+//them, or If-Range names another version than etag (pass NULL if the body has no ETag).
+int ICACHE_FLASH_ATTR httpdGetRange(HttpdConnData *conn, int size, const char *etag, int *start, int *end) {
+	char buff[64];
+	if (!httpdGetHeader(conn, "Range", buff, sizeof(buff))) return 0;
+	char ifRange[32];
+	if (httpdGetHeader(conn, "If-Range", ifRange, sizeof(ifRange)) &&
+			(etag == NULL || os_strcmp(ifRange, etag) != 0)) return 0;
+	if (os_strncmp(buff, "bytes=", 6) != 0 || os_strstr(buff, ",") != NULL) return 0;
+	char *p = buff+6, *dash = os_strstr(p, "-");
+	if (dash == NULL) return 0;
+	*dash = 0;
+	if (*p == 0) {
+		// the last n bytes
+		int n = atoi(dash+1);
+		if (n <= 0) return -1;
+		*start = n < size ? size-n : 0;
+		*end = size-1;
+	} else {
+		*start = atoi(p);
+		*end = dash[1] == 0 ? size-1 : atoi(dash+1);
+		if (*end >= size) *end = size-1;
+	}
+	return *start >= size || *start > *end ? -1 : 1;
 }
 
 //Send a http header.
@@ -239,10 +497,12 @@ void ICACHE_FLASH_ATTR httpdHeader(HttpdConnData *conn, const char *field, const
 
 	l=os_sprintf(buff, "%s: %s\r\n", field, val);
 	httpdSend(conn, buff, l);
+	if (os_strcmp(field, "Content-Length")==0) conn->priv->hasLength = true;
 }
 
 //Finish the headers.
 void ICACHE_FLASH_ATTR httpdEndHeaders(HttpdConnData *conn) {
+	conn->priv->headEnd = conn->priv->sendBuffLen;
 	httpdSend(conn, "\r\n", -1);
 }
 
@@ -251,7 +511,10 @@ void ICACHE_FLASH_ATTR httpdEndHeaders(HttpdConnData *conn) {
 void ICACHE_FLASH_ATTR httpdRedirect(HttpdConnData *conn, char *newUrl) {
 	char buff[1024];
 	int l;
-	l=os_sprintf(buff, "HTTP/1.0 302 Found\r\nServer: esp8266-link\r\nConnection: close\r\nLocation: %s\r\n\r\nRedirecting to %s\r\n", newUrl, newUrl);
+	httpdStartResponse(conn, 302);
+	httpdHeader(conn, "Location", newUrl);
+	httpdEndHeaders(conn);
+	l=os_sprintf(buff, "Redirecting to %s\r\n", newUrl);
 	httpdSend(conn, buff, l);
 }
 
@@ -271,7 +534,7 @@ int ICACHE_FLASH_ATTR cgiRedirect(HttpdConnData *connData) {
 //Returns 1 for success, 0 for out-of-memory.
 int ICACHE_FLASH_ATTR httpdSend(HttpdConnData *conn, const char *data, int len) {
 	if (len<0) len=strlen(data);
-	if (conn->priv->sendBuffLen+len>MAX_SENDBUFF_LEN) {
+	if (conn->priv->sendBuffLen+len>MAX_SENDBUFF_LEN-CHUNK_TRAILER) {
 		os_printf("%s ERROR! httpdSend full (%d of %d)\n",
 				connStr, conn->priv->sendBuffLen, MAX_SENDBUFF_LEN);
 		return 0;
@@ -281,46 +544,326 @@ int ICACHE_FLASH_ATTR httpdSend(HttpdConnData *conn, const char *data, int len)
 	return 1;
 }
 
+//Direct access to the free part of the send buffer for cgis that produce data in place, e.g.
+//by reading it from flash: write up to httpdSendFree bytes to the returned pointer and then
+//account for them with httpdSendCommit.
+char ICACHE_FLASH_ATTR *httpdSendPtr(HttpdConnData *conn) {
+	return conn->priv->sendBuff+conn->priv->sendBuffLen;
+}
+
+void ICACHE_FLASH_ATTR httpdSendCommit(HttpdConnData *conn, int len) {
+	if (len > 0) conn->priv->sendBuffLen+=len;
+}
+
+//Returns how many more bytes httpdSend accepts in this call. Cgis producing long responses
+//fill the buffer up to this and return HTTPD_CGI_MORE to get called again for the rest.
+int ICACHE_FLASH_ATTR httpdSendFree(HttpdConnData *conn) {
+	int free=MAX_SENDBUFF_LEN-CHUNK_TRAILER-conn->priv->sendBuffLen;
+	//leave room for the headers httpdFinishHeaders adds
+	if (conn->priv->headEnd>=0) free-=HEADER_RESERVE;
+	return free<0 ? 0 : free;
+}
+
+//Get the send buffer ready for a callback, in chunked mode leave room for a chunk header
+static void ICACHE_FLASH_ATTR httpdInitSendBuff(HttpdConnData *conn, char *buff) {
+	conn->priv->sendBuff=buff;
+	conn->priv->sendBuffStart=conn->priv->chunked ? CHUNK_HDR : 0;
+	conn->priv->sendBuffLen=conn->priv->sendBuffStart;
+	conn->priv->headEnd=-1;
+}
+
+//Insert data at position pos of the send buffer, returns false if there is no room
+static bool ICACHE_FLASH_ATTR httpdSendInsert(HttpdConnData *conn, int pos, const char *data, int len) {
+	HttpdPriv *priv = conn->priv;
+	if (priv->sendBuffLen+len > MAX_SENDBUFF_LEN-CHUNK_TRAILER) return false;
+	char *p = priv->sendBuff+pos;
+	os_memmove(p+len, p, priv->sendBuffLen-pos);
+	os_memcpy(p, data, len);
+	priv->sendBuffLen += len;
+	return true;
+}
+
 //Helper function to send any data in conn->priv->sendBuff
 static void ICACHE_FLASH_ATTR xmitSendBuff(HttpdConnData *conn) {
-	if (conn->priv->sendBuffLen!=0) {
-		sint8 status = espconn_sent(conn->conn, (uint8_t*)conn->priv->sendBuff, conn->priv->sendBuffLen);
+	HttpdPriv *priv = conn->priv;
+	if (priv->sendBuffLen>priv->sendBuffStart) {
+		sint8 status = espconn_sent(conn->conn, (uint8_t*)priv->sendBuff+priv->sendBuffStart,
+				priv->sendBuffLen-priv->sendBuffStart);
 		if (status != 0) {
-			os_printf("%s ERROR! espconn_sent returned %d\n", connStr, status);
+			//No sent callback is going to come and the data can't be kept around in the shared
+			//buffer, so give up on the connection rather than leave it stalled
+			os_printf("%s ERROR! espconn_sent returned %d, closing\n", connStr, status);
+			priv->keepAlive = false;
+			priv->closing = true;
+			espconn_disconnect(conn->conn);
+		} else {
+			priv->respLen += priv->sendBuffLen-priv->sendBuffStart;
 		}
-		conn->priv->sendBuffLen=0;
 	}
+	priv->sendBuffLen=priv->sendBuffStart;
 }
 
-//Callback called when the data on a socket has been successfully sent.
-static void ICACHE_FLASH_ATTR httpdSentCb(void *arg) {
-	debugConn(arg, "httpdSentCb");
-	int r;
-	HttpdConnData *conn=httpdFindConnData(arg);
-	char sendBuff[MAX_SENDBUFF_LEN];
+//If the response headers were completed in the current send buffer, add the Content-Length
+//(if the cgi is done, the whole body is in the buffer too) and the Connection header. If the
+//cgi isn't done and didn't give a length, HTTP/1.1 clients get the rest of the response in
+//chunked encoding, others get the connection closed at the end. So does a canned response
+//that didn't go through httpdStartResponse/httpdEndHeaders.
+static void ICACHE_FLASH_ATTR httpdFinishHeaders(HttpdConnData *conn, bool done) {
+	HttpdPriv *priv = conn->priv;
+	if (priv->headEnd < 0) {
+		if (!priv->respStarted && priv->sendBuffLen > priv->sendBuffStart) priv->keepAlive = false;
+		return;
+	}
 
-	if (conn==NULL) return;
-	conn->priv->sendBuff=sendBuff;
-	conn->priv->sendBuffLen=0;
+	char buff[HEADER_RESERVE];
+	int l = 0;
+	if (!priv->hasLength) {
+		if (done) {
+			l = os_sprintf(buff, "Content-Length: %d\r\n", priv->sendBuffLen-priv->headEnd-2);
+		} else if (priv->keepAlive && priv->http11) {
+			l = os_sprintf(buff, "Transfer-Encoding: chunked\r\n");
+			priv->chunked = true;
+		} else {
+			priv->keepAlive = false;
+		}
+	}
+	l += os_sprintf(buff+l, "Connection: %s\r\n", priv->keepAlive ? "keep-alive" : "close");
 
-	if (conn->cgi==NULL) { //Marked for destruction?
+	// whatever body came along with the headers becomes the first chunk
+	int bodyLen = priv->sendBuffLen-priv->headEnd-2;
+	char chunk[CHUNK_HDR+1];
+	int cl = priv->chunked && bodyLen > 0 ? os_sprintf(chunk, "%x\r\n", bodyLen) : 0;
+
+	if (priv->sendBuffLen+l+cl > MAX_SENDBUFF_LEN-CHUNK_TRAILER) {
+		// no room to insert, without a length the client reads until we close
+		priv->keepAlive = false;
+		priv->chunked = false;
+	} else {
+		httpdSendInsert(conn, priv->headEnd, buff, l);
+		if (cl > 0) {
+			httpdSendInsert(conn, priv->sendBuffLen-bodyLen, chunk, cl);
+			os_memcpy(priv->sendBuff+priv->sendBuffLen, "\r\n", 2);
+			priv->sendBuffLen += 2;
+		}
+	}
+	priv->headEnd = -1;
+}
+
+//In chunked mode turn the body in the send buffer into a chunk, using the room reserved in
+//front of it for the chunk header, and terminate the response if done
+static void ICACHE_FLASH_ATTR httpdFinishChunk(HttpdConnData *conn, bool done) {
+	HttpdPriv *priv = conn->priv;
+	int len = priv->sendBuffLen-CHUNK_HDR;
+	if (len > 0) {
+		char hdr[CHUNK_HDR+1];
+		int l = os_sprintf(hdr, "%x\r\n", len);
+		priv->sendBuffStart = CHUNK_HDR-l;
+		os_memcpy(priv->sendBuff+priv->sendBuffStart, hdr, l);
+		os_memcpy(priv->sendBuff+priv->sendBuffLen, "\r\n", 2);
+		priv->sendBuffLen += 2;
+	}
+	if (done) {
+		os_memcpy(priv->sendBuff+priv->sendBuffLen, "0\r\n\r\n", 5);
+		priv->sendBuffLen += 5;
+	}
+}
+
+//The response has been sent completely: wait for the next request or close the connection
+static void ICACHE_FLASH_ATTR httpdResponseDone(HttpdConnData *conn) {
+	if (!conn->priv->keepAlive) {
 		//os_printf("Closing 0x%p/0x%p->0x%p\n", arg, conn->conn, conn);
 		espconn_disconnect(conn->conn); // we will get a disconnect callback
-		return; //No need to call xmitSendBuff.
+		return;
 	}
+	httpdResetRequest(conn);
+	espconn_recv_unhold(conn->conn);
+}
 
+//Send what the cgi produced. If done, the response is complete once the sent callback
+//comes back, unless there was nothing left to send.
+static void ICACHE_FLASH_ATTR httpdXmitResponse(HttpdConnData *conn, bool done) {
+	if (conn->priv->chunked && conn->priv->headEnd < 0) {
+		httpdFinishChunk(conn, done);
+	} else {
+		httpdFinishHeaders(conn, done);
+	}
+	if (!done) {
+		xmitSendBuff(conn);
+		return;
+	}
+	conn->cgi=NULL; //mark as finished
+	if (conn->priv->sendBuffLen == conn->priv->sendBuffStart) {
+		httpdResponseDone(conn); // no sent callback is going to come
+	} else {
+		xmitSendBuff(conn);
+	}
+}
+
+//The cgi can't complete its response: close the connection without ending the response, so
+//the client can't take what it got for all of it. The disconnect callback calls the cgi to
+//clean up.
+static void ICACHE_FLASH_ATTR httpdAbort(HttpdConnData *conn) {
+	os_printf("%s Response aborted, closing\n", connStr);
+	conn->priv->keepAlive = false;
+	conn->priv->closing = true;
+	conn->priv->sendBuffLen = conn->priv->sendBuffStart;
+	espconn_disconnect(conn->conn); // we will get a disconnect callback
+}
+
+//Run the cgi of a connection to produce and send the next part of its response, returns the
+//number of bytes produced
+static int ICACHE_FLASH_ATTR httpdContinue(HttpdConnData *conn) {
+	int r;
+	debugConn(conn->conn, "httpdContinue");
+	conn->priv->ready = false;
+	httpdInitSendBuff(conn, sendBuff);
 	r=conn->cgi(conn); //Execute cgi fn.
-	if (r==HTTPD_CGI_DONE) {
-		conn->cgi=NULL; //mark for destruction.
+	if (r==HTTPD_CGI_ABORT) {
+		httpdAbort(conn);
+		return 0;
 	}
 	if (r==HTTPD_CGI_NOTFOUND || r==HTTPD_CGI_AUTHENTICATED) {
 		os_printf("%s ERROR! Bad CGI code %d\n", connStr, r);
-		conn->cgi=NULL; //mark for destruction.
+		conn->priv->keepAlive=false;
+		r=HTTPD_CGI_DONE;
+	}
+	int len = conn->priv->sendBuffLen-conn->priv->sendBuffStart;
+	httpdXmitResponse(conn, r==HTTPD_CGI_DONE);
+	return len;
+}
+
+static void ICACHE_FLASH_ATTR httpdPostTask(void) {
+	if (httpdTaskPosted) return;
+	httpdTaskPosted = system_os_post(HTTPD_TASK_PRIO, 0, 0);
+}
+
+//Scheduler for the continuations of streaming cgis. Each run serves the ready connections
+//round-robin, those with short responses (api calls, polls) first and then the bulk
+//transfers, until the budget is used up. If connections are left waiting the task posts
+//itself again, so the network stack and the uart task get to run in between.
+static void ICACHE_FLASH_ATTR httpdTask(os_event_t *events) {
+	httpdTaskPosted = false;
+	int budget = HTTPD_TASK_BUDGET;
+	bool waiting = false;
+	for (int bulk=0; bulk<2; bulk++) {
+		for (int n=0; n<MAX_CONN; n++) {
+			int i = (httpdNextConn+n) % MAX_CONN;
+			HttpdConnData *conn = &connData[i];
+			if (conn->conn == NULL || !conn->priv->ready) continue;
+			if (!bulk && conn->priv->respLen >= BULK_LEN) continue;
+			if (budget <= 0) {
+				waiting = true;
+				continue;
+			}
+			budget -= httpdContinue(conn);
+			httpdNextConn = (i+1) % MAX_CONN;
+		}
 	}
-	xmitSendBuff(conn);
+	if (waiting) httpdPostTask();
 }
 
-static const char *httpNotFoundHeader="HTTP/1.0 404 Not Found\r\nConnection: close\r\nContent-Type: text/plain\r\nContent-Length: 12\r\n\r\nNot Found.\r\n";
+//Callback called when the data on a socket has been successfully sent.
+static void ICACHE_FLASH_ATTR httpdSentCb(void *arg) {
+	debugConn(arg, "httpdSentCb");
+	HttpdConnData *conn=httpdFindConnData(arg);
+
+	if (conn==NULL || conn->priv->closing) return;
+	conn->priv->lastActive = system_get_time();
+
+	if (conn->cgi==NULL) { //Response finished?
+		httpdResponseDone(conn);
+		return; //No need to call xmitSendBuff.
+	}
+
+	//Leave producing the next part to the scheduler task
+	conn->priv->ready = true;
+	httpdPostTask();
+}
+
+//FNV-1a hash of len bytes of data, this is also what mkespfsimage stores for the ETags
+uint32_t ICACHE_FLASH_ATTR httpdHash(const char *data, int len) {
+	uint32_t h = 2166136261u;
+	while (len-- > 0) h = (h ^ (uint8_t)*data++) * 16777619u;
+	return h;
+}
+
+static uint32_t ICACHE_FLASH_ATTR httpdUrlHash(const char *url) {
+	return httpdHash(url, os_strlen(url));
+}
+
+//Compile builtInUrls into the route index
+static void ICACHE_FLASH_ATTR httpdCompileRoutes(void) {
+	int n=0;
+	while (builtInUrls[n].url!=NULL) n++;
+	exactRoutes=(HttpdRoute *)os_malloc(n*sizeof(HttpdRoute));
+	wildRoutes=(HttpdRoute *)os_malloc(n*sizeof(HttpdRoute));
+	numExact=numWild=0;
+	if (exactRoutes==NULL || wildRoutes==NULL) {
+		//httpdFindRoute scans the table instead
+		os_printf("Httpd: no memory for the route index\n");
+		if (exactRoutes!=NULL) os_free(exactRoutes);
+		if (wildRoutes!=NULL) os_free(wildRoutes);
+		exactRoutes=wildRoutes=NULL;
+		return;
+	}
+
+	for (int i=0; i<n; i++) {
+		const char *url=builtInUrls[i].url;
+		int len=os_strlen(url);
+		if (len>0 && url[len-1]=='*') {
+			wildRoutes[numWild].idx=i;
+			wildRoutes[numWild].len=len-1;
+			numWild++;
+		} else {
+			//insertion sort by hash, entries are added in table order so that stays sorted
+			HttpdRoute r = { httpdUrlHash(url), i, len };
+			int j=numExact++;
+			while (j>0 && exactRoutes[j-1].hash>r.hash) {
+				exactRoutes[j]=exactRoutes[j-1];
+				j--;
+			}
+			exactRoutes[j]=r;
+		}
+	}
+}
+
+//Returns the index of the first entry of builtInUrls at or after position 'from' that matches
+//the url, -1 if there is none.
+static int ICACHE_FLASH_ATTR httpdFindRoute(const char *url, int from) {
+	if (exactRoutes==NULL) {
+		//no route index, check the entries one by one
+		for (int i=from; builtInUrls[i].url!=NULL; i++) {
+			const char *u=builtInUrls[i].url;
+			int len=os_strlen(u);
+			if (os_strcmp(u, url)==0) return i;
+			if (len>0 && u[len-1]=='*' && os_strncmp(u, url, len-1)==0) return i;
+		}
+		return -1;
+	}
+	int best=-1;
+	uint32_t h=httpdUrlHash(url);
+	int lo=0, hi=numExact;
+	while (lo<hi) {
+		int m=(lo+hi)/2;
+		if (exactRoutes[m].hash<h) lo=m+1; else hi=m;
+	}
+	for (; lo<numExact && exactRoutes[lo].hash==h; lo++) {
+		int i=exactRoutes[lo].idx;
+		if (i>=from && os_strcmp(builtInUrls[i].url, url)==0) {
+			best=i;
+			break;
+		}
+	}
+	for (int w=0; w<numWild; w++) {
+		int i=wildRoutes[w].idx;
+		if (best>=0 && i>best) break;
+		if (i>=from && os_strncmp(builtInUrls[i].url, url, wildRoutes[w].len)==0) {
+			best=i;
+			break;
+		}
+	}
+	return best;
+}
 
 //This is called when the headers have been received and the connection is ready to send
 //the result headers and data.
@@ -330,49 +873,50 @@ static void ICACHE_FLASH_ATTR httpdProcessRequest(HttpdConnData *conn) {
 	int r;
 	int i=0;
 	if (conn->url==NULL) {
-		os_printf("%s WtF? url = NULL\n", connStr);
-		return; //Shouldn't happen
+		//No GET or POST request line we could make sense of. Receiving is held by now, so
+		//answer and close rather than leave the connection hanging.
+		os_printf("%s Bad request\n", connStr);
+		conn->priv->keepAlive=false;
+		httpdStartResponse(conn, 400);
+		httpdHeader(conn, "Content-Type", "text/plain");
+		httpdEndHeaders(conn);
+		httpdSend(conn, "Bad Request.\r\n", -1);
+		httpdXmitResponse(conn, true);
+		return;
 	}
 	//See if we can find a CGI that's happy to handle the request.
 	while (1) {
 		//Look up URL in the built-in URL table.
-		while (builtInUrls[i].url!=NULL) {
-			int match=0;
-			//See if there's a literal match
-			if (os_strcmp(builtInUrls[i].url, conn->url)==0) match=1;
-			//See if there's a wildcard match
-			if (builtInUrls[i].url[os_strlen(builtInUrls[i].url)-1]=='*' &&
-					os_strncmp(builtInUrls[i].url, conn->url, os_strlen(builtInUrls[i].url)-1)==0) match=1;
-			if (match) {
-				//os_printf("Is url index %d\n", i);
-				conn->cgiData=NULL;
-				conn->cgi=builtInUrls[i].cgiCb;
-				conn->cgiArg=builtInUrls[i].cgiArg;
-				break;
-			}
-			i++;
-		}
-		if (builtInUrls[i].url==NULL) {
+		i=httpdFindRoute(conn->url, i);
+		if (i<0) {
 			//Drat, we're at the end of the URL table. This usually shouldn't happen. Well, just
 			//generate a built-in 404 to handle this.
 			os_printf("%s %s not found. 404!\n", connStr, conn->url);
-			httpdSend(conn, httpNotFoundHeader, -1);
-			xmitSendBuff(conn);
-			conn->cgi=NULL; //mark for destruction
+			httpdStartResponse(conn, 404);
+			httpdHeader(conn, "Content-Type", "text/plain");
+			httpdEndHeaders(conn);
+			httpdSend(conn, "Not Found.\r\n", -1);
+			httpdXmitResponse(conn, true);
 			return;
 		}
+		//os_printf("Is url index %d\n", i);
+		conn->cgiData=NULL;
+		conn->cgi=builtInUrls[i].cgiCb;
+		conn->cgiArg=builtInUrls[i].cgiArg;
 
 		//Okay, we have a CGI function that matches the URL. See if it wants to handle the
 		//particular URL we're supposed to handle.
 		r=conn->cgi(conn);
 		if (r==HTTPD_CGI_MORE) {
 			//Yep, it's happy to do so and has more data to send.
-			xmitSendBuff(conn);
+			httpdXmitResponse(conn, false);
 			return;
 		} else if (r==HTTPD_CGI_DONE) {
 			//Yep, it's happy to do so and already is done sending data.
-			xmitSendBuff(conn);
-			conn->cgi=NULL; //mark conn for destruction
+			httpdXmitResponse(conn, true);
+			return;
+		} else if (r==HTTPD_CGI_ABORT) {
+			httpdAbort(conn);
 			return;
 		} else if (r==HTTPD_CGI_NOTFOUND || r==HTTPD_CGI_AUTHENTICATED) {
 			//URL doesn't want to handle the request: either the data isn't found or there's no
@@ -382,6 +926,50 @@ static void ICACHE_FLASH_ATTR httpdProcessRequest(HttpdConnData *conn) {
 	}
 }
 
+//Record where the name=value pairs of the query string are
+static void ICACHE_FLASH_ATTR httpdIndexArgs(HttpdConnData *conn) {
+	HttpdPriv *priv=conn->priv;
+	char *p=conn->getArgs;
+	while (*p!=0) {
+		char *e=p, *eq=NULL;
+		while (*e!=0 && *e!='&') {
+			if (eq==NULL && *e=='=') eq=e;
+			e++;
+		}
+		if (eq!=NULL) {
+			if (priv->numArgs==MAX_ARGS) {
+				priv->argsOverflow=true;
+				return;
+			}
+			HttpdSpan *a=&priv->args[priv->numArgs++];
+			a->name=p-priv->head;
+			a->nameLen=eq-p;
+			a->value=eq+1-priv->head;
+			a->valueLen=e-eq-1;
+		}
+		p = *e!=0 ? e+1 : e;
+	}
+}
+
+//Record where the name and value of a header line are
+static void ICACHE_FLASH_ATTR httpdIndexHeader(char *h, HttpdConnData *conn) {
+	HttpdPriv *priv=conn->priv;
+	char *v=h;
+	while (*v!=0 && *v!=':') v++;
+	if (*v==0) return;
+	if (priv->numHeaders==MAX_HEADERS) {
+		priv->headersOverflow=true;
+		return;
+	}
+	HttpdSpan *s=&priv->headers[priv->numHeaders++];
+	s->name=h-priv->head;
+	s->nameLen=v-h;
+	v++;
+	while (*v==' ') v++;
+	s->value=v-priv->head;
+	s->valueLen=os_strlen(v);
+}
+
 //Parse a line of header data and modify the connection data accordingly.
 static void ICACHE_FLASH_ATTR httpdParseHeader(char *h, HttpdConnData *conn) {
 	int i;
@@ -405,8 +993,14 @@ static void ICACHE_FLASH_ATTR httpdParseHeader(char *h, HttpdConnData *conn) {
 
 		//Figure out end of url.
 		e=(char*)os_strstr(conn->url, " ");
-		if (e==NULL) return; //wtf?
+		if (e==NULL) {
+			conn->url=NULL; //no HTTP version, gets a 400
+			return;
+		}
 		*e=0; //terminate url part
+		//HTTP/1.1 connections are persistent unless the client says otherwise
+		conn->priv->http11 = os_strncmp(e+1, "HTTP/1.1", 8)==0;
+		conn->priv->keepAlive = conn->priv->http11;
 
 		// Count number of open connections
 		int open = 0;
@@ -420,11 +1014,15 @@ static void ICACHE_FLASH_ATTR httpdParseHeader(char *h, HttpdConnData *conn) {
 			*conn->getArgs=0;
 			conn->getArgs++;
 			os_printf("%s args = %s\n", connStr, conn->getArgs);
+			httpdIndexArgs(conn);
 		} else {
 			conn->getArgs=NULL;
 		}
+		return;
+	}
 
-	} else if (os_strncmp(h, "Content-Length:", 15)==0) {
+	httpdIndexHeader(h, conn);
+	if (httpdNameMatch(h, "Content-Length:", 15)) {
 		i=15;
 		//Skip trailing spaces
 		while (h[i]==' ') i++;
@@ -441,7 +1039,10 @@ static void ICACHE_FLASH_ATTR httpdParseHeader(char *h, HttpdConnData *conn) {
 		//os_printf("Mallocced buffer for %d + 1 bytes of post data.\n", conn->post->buffSize);
 		conn->post->buff=(char*)os_malloc(conn->post->buffSize + 1);
 		conn->post->buffLen=0;
-	} else if (os_strncmp(h, "Content-Type: ", 14)==0) {
+	} else if (httpdNameMatch(h, "Connection:", 11)) {
+		if (os_strstr(h, "close") || os_strstr(h, "Close")) conn->priv->keepAlive = false;
+		else if (os_strstr(h, "keep-alive") || os_strstr(h, "Keep-Alive")) conn->priv->keepAlive = true;
+	} else if (httpdNameMatch(h, "Content-Type:", 13)) {
 		if (os_strstr(h, "multipart/form-data")) {
 			// It's multipart form data so let's pull out the boundary for future use
 			char *b;
@@ -456,80 +1057,239 @@ static void ICACHE_FLASH_ATTR httpdParseHeader(char *h, HttpdConnData *conn) {
 }
 
 
+//Append a piece of the request head, whatever doesn't fit into MAX_HEAD_LEN is dropped
+static void ICACHE_FLASH_ATTR httpdHeadAppend(HttpdConnData *conn, char *data, int len) {
+	HttpdPriv *priv=conn->priv;
+	if (priv->lineLen==0 && len>0) priv->lineFirst=data[0];
+	priv->lineLen+=len;
+	if (len>MAX_HEAD_LEN-1-priv->headPos) len=MAX_HEAD_LEN-1-priv->headPos;
+	os_memcpy(priv->head+priv->headPos, data, len);
+	priv->headPos+=len;
+	priv->head[priv->headPos]=0;
+}
+
+//A complete line of the head has been received, parse it. The line is left in the head
+//zero-terminated in place of its \r, which is what httpdGetHeader expects. Returns true if
+//this was the empty line ending the head.
+static bool ICACHE_FLASH_ATTR httpdHeadLine(HttpdConnData *conn) {
+	HttpdPriv *priv=conn->priv;
+	int start=priv->lineStart;
+	int lineLen=priv->lineLen;
+	char *line=priv->head+start;
+	priv->lineStart=priv->headPos;
+	priv->lineLen=0;
+
+	if (lineLen==1 || (lineLen==2 && priv->lineFirst=='\r')) return true;
+	//Ignore a line that got truncated because the head is full
+	if (priv->headPos-start!=lineLen) return false;
+	char *e=priv->head+priv->headPos-1;
+	if (e>line && e[-1]=='\r') e--;
+	*e=0;
+	httpdParseHeader(line, conn);
+	return false;
+}
+
+//The whole request has been received. Stop receiving until the response has been sent so
+//the next request on a keep-alive connection doesn't overwrite this one. We don't support
+//pipelining: if more data came along with the request, close after the response instead.
+static void ICACHE_FLASH_ATTR httpdRequestComplete(HttpdConnData *conn, int extra) {
+	if (extra > 0) {
+		os_printf("%s %d bytes after request, closing\n", connStr, extra);
+		conn->priv->keepAlive = false;
+	}
+	espconn_recv_hold(conn->conn);
+}
+
 //Callback called when there's data available on a socket.
 static void ICACHE_FLASH_ATTR httpdRecvCb(void *arg, char *data, unsigned short len) {
 	debugConn(arg, "httpdRecvCb");
-	int x;
-	char *p, *e;
-	char sendBuff[MAX_SENDBUFF_LEN];
 	HttpdConnData *conn=httpdFindConnData(arg);
 	if (conn==NULL) return;
-	conn->priv->sendBuff=sendBuff;
-	conn->priv->sendBuffLen=0;
+	HttpdPriv *priv=conn->priv;
+	httpdInitSendBuff(conn, sendBuff);
+	priv->lastActive = system_get_time();
+	//The request starts with its first byte, not when the connection became ready for it
+	if (priv->inHead && priv->headPos==0 && priv->lineLen==0) conn->startTime = priv->lastActive;
 
-	//This is slightly evil/dirty: we abuse conn->post->len as a state variable for where in the http communications we are:
+	//The parser is resumable: priv->inHead says we're still receiving the head, which is
+	//consumed a line at a time, and conn->post->len says whether POST data follows it:
 	//<0 (-1): Post len unknown because we're still receiving headers
 	//==0: No post data
 	//>0: Need to receive post data
-	//ToDo: See if we can use something more elegant for this.
-
-	for (x=0; x<len; x++) {
-		if (conn->post->len<0) {
-			//This byte is a header byte.
-			if (conn->priv->headPos!=MAX_HEAD_LEN) conn->priv->head[conn->priv->headPos++]=data[x];
-			conn->priv->head[conn->priv->headPos]=0;
-			//Scan for /r/n/r/n. Receiving this indicate the headers end.
-			if (data[x]=='\n' && (char *)os_strstr(conn->priv->head, "\r\n\r\n")!=NULL) {
-				//Indicate we're done with the headers.
-				conn->post->len=0;
-				//Reset url data
-				conn->url=NULL;
-				//Iterate over all received headers and parse them.
-				p=conn->priv->head;
-				while(p<(&conn->priv->head[conn->priv->headPos-4])) {
-					e=(char *)os_strstr(p, "\r\n"); //Find end of header line
-					if (e==NULL) break;			//Shouldn't happen.
-					e[0]=0;						//Zero-terminate header
-					httpdParseHeader(p, conn);	//and parse it.
-					p=e+2;						//Skip /r/n (now /0/n)
-				}
+	char *end=data+len;
+	while (data<end) {
+		if (priv->inHead) {
+			//Copy up to and including the next newline in one go
+			char *e=data;
+			while (e<end && *e!='\n') e++;
+			if (e<end) e++;
+			httpdHeadAppend(conn, data, e-data);
+			bool eol = e[-1]=='\n';
+			data=e;
+			if (eol && httpdHeadLine(conn)) {
+				//That was the empty line ending the head
+				priv->inHead=false;
+				if (conn->post->len<0) conn->post->len=0;
 				//If we don't need to receive post data, we can send the response now.
 				if (conn->post->len==0) {
+					httpdRequestComplete(conn, end-data);
 					httpdProcessRequest(conn);
+					return;
 				}
 			}
-		} else if (conn->post->len!=0) {
-			//This byte is a POST byte.
-			conn->post->buff[conn->post->buffLen++]=data[x];
-			conn->post->received++;
-			if (conn->post->buffLen >= conn->post->buffSize || conn->post->received == conn->post->len) {
+		} else if (conn->post->len>0) {
+			//Copy as much POST data as fits into the current chunk
+			HttpdPostData *post=conn->post;
+			int n=end-data;
+			if (n>post->buffSize-post->buffLen) n=post->buffSize-post->buffLen;
+			if (n>post->len-post->received) n=post->len-post->received;
+			os_memcpy(post->buff+post->buffLen, data, n);
+			post->buffLen+=n;
+			post->received+=n;
+			data+=n;
+			if (post->buffLen >= post->buffSize || post->received == post->len) {
 				//Received a chunk of post data
-				conn->post->buff[conn->post->buffLen]=0; //zero-terminate, in case the cgi handler knows it can use strings
+				post->buff[post->buffLen]=0; //zero-terminate, in case the cgi handler knows it can use strings
+				if (post->received == post->len) httpdRequestComplete(conn, end-data);
 				//Send the response.
 				httpdProcessRequest(conn);
-				conn->post->buffLen = 0;
+				post->buffLen = 0;
+				if (post->received == post->len) return;
 			}
+		} else {
+			break; //shouldn't happen, receiving is held once the request is complete
 		}
 	}
 }
 
+//Removes a connection from the backlog, returns false if it isn't in there. Like in
+//httpdFindConnData the SDK may hand us a different espconn, so match the remote IP:port.
+static bool ICACHE_FLASH_ATTR httpdBacklogRemove(struct espconn *espconn) {
+	for (int i=0; i<backlogLen; i++) {
+		if (backlog[i].remote_port == espconn->proto.tcp->remote_port &&
+				os_memcmp(backlog[i].remote_ip, espconn->proto.tcp->remote_ip, 4) == 0) {
+			backlogLen--;
+			os_memmove(backlog+i, backlog+i+1, (backlogLen-i)*sizeof(HttpdBacklog));
+			return true;
+		}
+	}
+	return false;
+}
+
+static void ICACHE_FLASH_ATTR httpdDisconCb(void *arg);
+static void ICACHE_FLASH_ATTR httpdReconCb(void *arg, sint8 err);
+
+//Attaches an esp connection to pool slot i
+static void ICACHE_FLASH_ATTR httpdSetupConn(int i, struct espconn *conn) {
+	httpdStats.accepted++;
+	connData[i].priv=&connPrivData[i];
+	connData[i].conn=conn;
+	conn->reverse=&connData[i];
+	connData[i].remote_port = conn->proto.tcp->remote_port;
+	os_memcpy(connData[i].remote_ip, conn->proto.tcp->remote_ip, 4);
+	connData[i].post=&connPostData[i];
+	connData[i].post->buff=NULL;
+	connData[i].priv->closing=false;
+	httpdResetRequest(&connData[i]);
+
+	espconn_regist_recvcb(conn, httpdRecvCb);
+	espconn_regist_reconcb(conn, httpdReconCb);
+	espconn_regist_disconcb(conn, httpdDisconCb);
+	espconn_regist_sentcb(conn, httpdSentCb);
+
+	//don't hold back the last, partial segment of a response until the previous one is acked
+	espconn_set_opt(conn, ESPCONN_REUSEADDR|ESPCONN_NODELAY);
+	espconn_regist_time(conn, STALL_TIMEOUT, 1);
+}
+
+//A slot got free, give it to the connection that has been waiting longest
+static void ICACHE_FLASH_ATTR httpdAcceptBacklog(HttpdConnData *conn) {
+	if (backlogLen == 0) return;
+	struct espconn *espconn = backlog[0].conn;
+	backlogLen--;
+	os_memmove(backlog, backlog+1, backlogLen*sizeof(HttpdBacklog));
+	httpdSetupConn(conn-connData, espconn);
+	espconn_recv_unhold(espconn);
+}
+
 static void ICACHE_FLASH_ATTR httpdDisconCb(void *arg) {
 	debugConn(arg, "httpdDisconCb");
+	if (httpdBacklogRemove(arg)) return;
 	HttpdConnData *conn = httpdFindConnData(arg);
 	if (conn == NULL) return;
 	httpdRetireConn(conn);
+	httpdAcceptBacklog(conn);
 }
 
 // Callback indicating a failure in the connection. "Recon" is probably intended in the sense
 // of "you need to reconnect". Sigh... Note that there is no DiconCb after ReconCb
 static void ICACHE_FLASH_ATTR httpdReconCb(void *arg, sint8 err) {
 	debugConn(arg, "httpdReconCb");
+	if (httpdBacklogRemove(arg)) return;
 	HttpdConnData *conn = httpdFindConnData(arg);
 	os_printf("%s ***** reset, err=%d\n", connStr, err);
 	if (conn == NULL) return;
 	httpdRetireConn(conn);
+	httpdAcceptBacklog(conn);
+}
+
+//A connection is idle between keep-alive requests, before the first byte of the next one
+static bool ICACHE_FLASH_ATTR httpdConnIdle(HttpdConnData *conn) {
+	return conn->conn != NULL && !conn->priv->closing && conn->cgi == NULL &&
+			conn->priv->inHead && conn->priv->headPos == 0 && conn->priv->lineLen == 0;
+}
+
+//Once a second: close idle connections and connections that are too slow sending the request
+//head, and drop connections that waited too long in the backlog.
+static void ICACHE_FLASH_ATTR httpdTimerCb(void *arg) {
+	uint32 now = system_get_time();
+	for (int i=0; i<MAX_CONN; i++) {
+		HttpdConnData *conn = &connData[i];
+		if (conn->conn == NULL || conn->priv->closing) continue;
+		if (httpdConnIdle(conn)) {
+			if (now - conn->priv->lastActive < IDLE_TIMEOUT*1000000) continue;
+			httpdStats.idleTimeouts++;
+		} else if (conn->priv->inHead) {
+			if (now - conn->startTime < HEAD_TIMEOUT*1000000) continue;
+			httpdStats.headTimeouts++;
+		} else {
+			continue;
+		}
+		debugConn(conn->conn, "timeout");
+		os_printf("%s Timeout, closing\n", connStr);
+		conn->priv->closing = true;
+		espconn_disconnect(conn->conn); // we will get a disconnect callback
+	}
+
+	while (backlogLen > 0 && now - backlog[0].since >= BACKLOG_TIMEOUT*1000000) {
+		struct espconn *espconn = backlog[0].conn;
+		backlogLen--;
+		os_memmove(backlog, backlog+1, backlogLen*sizeof(HttpdBacklog));
+		httpdStats.rejected++;
+		espconn_disconnect(espconn);
+	}
 }
 
+//All slots are busy: close the least recently active idle keep-alive connection and return
+//its slot, -1 if there is none.
+static int ICACHE_FLASH_ATTR httpdEvict(void) {
+	int lru = -1;
+	uint32 now = system_get_time();
+	for (int i=0; i<MAX_CONN; i++) {
+		if (httpdConnIdle(&connData[i]) && (lru < 0 ||
+				now-connData[i].priv->lastActive > now-connData[lru].priv->lastActive))
+			lru = i;
+	}
+	if (lru < 0) return -1;
+	// the slot is needed now, so retire it before the disconnect callback, which then won't
+	// find the connection anymore
+	struct espconn *espconn = connData[lru].conn;
+	httpdStats.evicted++;
+	debugConn(espconn, "evict");
+	httpdRetireConn(&connData[lru]);
+	espconn_disconnect(espconn);
+	return lru;
+}
 
 static void ICACHE_FLASH_ATTR httpdConnectCb(void *arg) {
 	debugConn(arg, "httpdConnectCb");
@@ -539,8 +1299,27 @@ static void ICACHE_FLASH_ATTR httpdConnectCb(void *arg) {
 	for (i=0; i<MAX_CONN; i++) if (connData[i].conn==NULL) break;
 	//os_printf("Con req, conn=%p, pool slot %d\n", conn, i);
 	if (i==MAX_CONN) {
-		os_printf("%s Aiee, conn pool overflow!\n", connStr);
-		espconn_disconnect(conn);
+		i=httpdEvict();
+		debugConn(arg, "httpdConnectCb");
+	}
+	if (i<0) {
+		if (backlogLen==MAX_BACKLOG) {
+			os_printf("%s Aiee, conn pool overflow!\n", connStr);
+			httpdStats.rejected++;
+			espconn_disconnect(conn);
+			return;
+		}
+		//Let it wait for a slot without receiving anything
+		HttpdBacklog *b = &backlog[backlogLen++];
+		b->conn = conn;
+		b->remote_port = conn->proto.tcp->remote_port;
+		os_memcpy(b->remote_ip, conn->proto.tcp->remote_ip, 4);
+		b->since = system_get_time();
+		conn->reverse = NULL;
+		httpdStats.queued++;
+		espconn_recv_hold(conn);
+		espconn_regist_reconcb(conn, httpdReconCb);
+		espconn_regist_disconcb(conn, httpdDisconCb);
 		return;
 	}
 
@@ -550,24 +1329,7 @@ static void ICACHE_FLASH_ATTR httpdConnectCb(void *arg) {
 	os_printf("%s Connect (%d open)\n", connStr, num+1);
 #endif
 
-	connData[i].priv=&connPrivData[i];
-	connData[i].conn=conn;
-	connData[i].remote_port = conn->proto.tcp->remote_port;
-	os_memcpy(connData[i].remote_ip, conn->proto.tcp->remote_ip, 4);
-	connData[i].priv->headPos=0;
-	connData[i].post=&connPostData[i];
-	connData[i].post->buff=NULL;
-	connData[i].post->buffLen=0;
-	connData[i].post->received=0;
-	connData[i].post->len=-1;
-	connData[i].startTime = system_get_time();
-
-	espconn_regist_recvcb(conn, httpdRecvCb);
-	espconn_regist_reconcb(conn, httpdReconCb);
-	espconn_regist_disconcb(conn, httpdDisconCb);
-	espconn_regist_sentcb(conn, httpdSentCb);
-
-	espconn_set_opt(conn, ESPCONN_REUSEADDR|ESPCONN_NODELAY);
+	httpdSetupConn(i, conn);
 }
 
 //Httpd initialization routine. Call this to kick off webserver functionality.
@@ -582,9 +1344,16 @@ void ICACHE_FLASH_ATTR httpdInit(HttpdBuiltInUrl *fixedUrls, int port) {
 	httpdTcp.local_port=port;
 	httpdConn.proto.tcp=&httpdTcp;
 	builtInUrls=fixedUrls;
+	httpdCompileRoutes();
 
 	os_printf("Httpd init, conn=%p\n", &httpdConn);
 	espconn_regist_connectcb(&httpdConn, httpdConnectCb);
 	espconn_accept(&httpdConn);
-	espconn_tcp_set_max_con_allow(&httpdConn, MAX_CONN);
+	espconn_tcp_set_max_con_allow(&httpdConn, MAX_CONN+MAX_BACKLOG);
+
+	system_os_task(httpdTask, HTTPD_TASK_PRIO, httpdTaskQueue, HTTPD_TASK_QUEUE_LEN);
+
+	os_timer_disarm(&httpdTimer);
+	os_timer_setfn(&httpdTimer, httpdTimerCb, NULL);
+	os_timer_arm(&httpdTimer, 1000, 1);
 }
@@ -7,6 +7,7 @@
 #define HTTPD_CGI_DONE 1
 #define HTTPD_CGI_NOTFOUND 2
 #define HTTPD_CGI_AUTHENTICATED 3
+#define HTTPD_CGI_ABORT 4 // response can't be completed, close without ending it
 
 #define HTTPD_METHOD_GET 1
 #define HTTPD_METHOD_POST 2
@@ -54,16 +55,35 @@ typedef struct {
 	const void *cgiArg;
 } HttpdBuiltInUrl;
 
+//Connection pool counters
+typedef struct {
+	uint32_t accepted;     // connections that got a slot
+	uint32_t queued;       // connections that had to wait in the backlog for a slot
+	uint32_t rejected;     // connections closed because no slot got free in time
+	uint32_t evicted;      // idle keep-alive connections closed to make room for a new one
+	uint32_t idleTimeouts; // idle keep-alive connections closed
+	uint32_t headTimeouts; // connections closed because the request head took too long
+} HttpdStats;
+extern HttpdStats httpdStats;
+
 int ICACHE_FLASH_ATTR cgiRedirect(HttpdConnData *connData);
 void ICACHE_FLASH_ATTR httpdRedirect(HttpdConnData *conn, char *newUrl);
 int httpdUrlDecode(char *val, int valLen, char *ret, int retLen);
 int ICACHE_FLASH_ATTR httpdFindArg(char *line, char *arg, char *buff, int buffLen);
+int ICACHE_FLASH_ATTR httpdGetArg(HttpdConnData *conn, char *arg, char *buff, int buffLen);
 void ICACHE_FLASH_ATTR httpdInit(HttpdBuiltInUrl *fixedUrls, int port);
 const char *httpdGetMimetype(char *url);
 void ICACHE_FLASH_ATTR httpdStartResponse(HttpdConnData *conn, int code);
 void ICACHE_FLASH_ATTR httpdHeader(HttpdConnData *conn, const char *field, const char *val);
 void ICACHE_FLASH_ATTR httpdEndHeaders(HttpdConnData *conn);
+char ICACHE_FLASH_ATTR *httpdStartRawResponse(HttpdConnData *conn, int len);
+uint32_t ICACHE_FLASH_ATTR httpdHash(const char *data, int len);
+bool ICACHE_FLASH_ATTR httpdETagMatch(HttpdConnData *conn, uint32_t hash, char *etag);
 int ICACHE_FLASH_ATTR httpdGetHeader(HttpdConnData *conn, char *header, char *ret, int retLen);
+int ICACHE_FLASH_ATTR httpdGetRange(HttpdConnData *conn, int size, const char *etag, int *start, int *end);
 int ICACHE_FLASH_ATTR httpdSend(HttpdConnData *conn, const char *data, int len);
+int ICACHE_FLASH_ATTR httpdSendFree(HttpdConnData *conn);
+char ICACHE_FLASH_ATTR *httpdSendPtr(HttpdConnData *conn);
+void ICACHE_FLASH_ATTR httpdSendCommit(HttpdConnData *conn, int len);
 
 #endif
@@ -19,19 +19,185 @@ Connector to let httpd use the espfs filesystem to serve the files in it.
 #include "espfsformat.h"
 #include "cgi.h"
 
+#ifndef ESPFS_CACHE_BUDGET
+#define ESPFS_CACHE_BUDGET 0
+#endif
+EspFsCacheStats espFsCacheStats = { .budget = ESPFS_CACHE_BUDGET };
+
 // The static files marked with FLAG_GZIP are compressed and will be served with GZIP compression.
 // If the client does not advertise that he accepts GZIP send following warning message (telnet users for e.g.)
 static const char *gzipNonSupportedMessage = "HTTP/1.0 501 Not implemented\r\nServer: esp8266-httpd/"HTTPDVER"\r\nConnection: close\r\nContent-Type: text/plain\r\nContent-Length: 52\r\n\r\nYour browser does not accept gzip-compressed data.\r\n";
 
 
+#if ESPFS_CACHE_BUDGET > 0
+// RAM cache of small, popular files. The requested urls are tracked with a request count, a
+// file gets loaded into RAM with its pre-rendered head once it has been asked for
+// ESPFS_CACHE_ADMIT times, evicting less requested files if the budget is exhausted. A cached
+// file is small enough to go out in a single cgi call, without opening it in espfs.
+#define ESPFS_CACHE_TRACK 16    // urls tracked
+#define ESPFS_CACHE_ADMIT 3     // requests before a file gets cached
+#define ESPFS_CACHE_MAX_FILE 1024 // largest file that gets cached
+#define ESPFS_CACHE_DECAY 256   // requests after which all counts get halved
+
+typedef struct {
+	uint32_t urlHash;
+	uint16_t count;    // requests, halved every ESPFS_CACHE_DECAY requests
+	uint8_t noCache;   // file can't be cached: missing, too large, no head
+	uint8_t gzip;
+	uint32_t hash;     // content hash for the ETag
+	uint16_t urlLen, headLen, len;
+	char *data;        // url, head and file contents when cached, else NULL
+} CacheEntry;
+
+static CacheEntry cache[ESPFS_CACHE_TRACK];
+static uint16_t cacheRequests;
+
+static int ICACHE_FLASH_ATTR cacheSize(CacheEntry *e) {
+	return e->urlLen+e->headLen+e->len;
+}
+
+static void ICACHE_FLASH_ATTR cacheDrop(CacheEntry *e) {
+	if (e->data == NULL) return;
+	espFsCacheStats.used -= cacheSize(e);
+	espFsCacheStats.files--;
+	os_free(e->data);
+	e->data = NULL;
+}
+
+// Forget everything cached, the files come from a different espfs image now
+void ICACHE_FLASH_ATTR espFsCacheFlush(void) {
+	for (CacheEntry *e = cache; e < cache+ESPFS_CACHE_TRACK; e++) cacheDrop(e);
+	os_memset(cache, 0, sizeof(cache));
+}
+
+// Find the entry for the url, starting to track it if it isn't yet. Returns NULL if all
+// entries are busy with more popular urls.
+static CacheEntry ICACHE_FLASH_ATTR *cacheFind(char *url) {
+	int urlLen = os_strlen(url);
+	uint32_t urlHash = httpdHash(url, urlLen);
+	CacheEntry *e, *victim = NULL;
+	for (e = cache; e < cache+ESPFS_CACHE_TRACK; e++) {
+		if ((e->count > 0 || e->data != NULL) && e->urlHash == urlHash &&
+				(e->data == NULL || os_strcmp(e->data, url) == 0)) return e;
+		if (e->data == NULL && (victim == NULL || e->count < victim->count)) victim = e;
+	}
+	if (victim == NULL || victim->count > 1) return NULL;
+	os_memset(victim, 0, sizeof(CacheEntry));
+	victim->urlHash = urlHash;
+	return victim;
+}
+
+// Load the file into RAM if it's suitable and there's room, returns true if it's cached now
+static bool ICACHE_FLASH_ATTR cacheLoad(CacheEntry *e, char *url) {
+	EspFsFile *file = espFsOpen(url);
+	if (file == NULL) return false; // may just be out of handles, try again next time
+	int len = espFsSize(file);
+	int headLen = espFsHead(file, NULL, 0);
+	int urlLen = os_strlen(url)+1;
+	int size = urlLen+headLen+len;
+	if (len > ESPFS_CACHE_MAX_FILE || headLen <= 0 || size > ESPFS_CACHE_BUDGET ||
+			!espFsHash(file, &e->hash)) {
+		e->noCache = 1;
+		espFsClose(file);
+		return false;
+	}
+	// make room by dropping files that are requested less
+	while (espFsCacheStats.used+size > ESPFS_CACHE_BUDGET) {
+		CacheEntry *victim = NULL;
+		for (CacheEntry *c = cache; c < cache+ESPFS_CACHE_TRACK; c++) {
+			if (c->data != NULL && c->count < e->count && (victim == NULL || c->count < victim->count))
+				victim = c;
+		}
+		if (victim == NULL) {
+			espFsClose(file);
+			return false;
+		}
+		cacheDrop(victim);
+	}
+	e->data = os_malloc(size);
+	if (e->data == NULL) {
+		espFsClose(file);
+		return false;
+	}
+	os_memcpy(e->data, url, urlLen);
+	espFsHead(file, e->data+urlLen, headLen);
+	if (espFsRead(file, e->data+urlLen+headLen, len) != len) {
+		os_free(e->data);
+		e->data = NULL;
+		e->noCache = 1;
+		espFsClose(file);
+		return false;
+	}
+	e->gzip = (espFsFlags(file) & FLAG_GZIP) != 0;
+	e->urlLen = urlLen;
+	e->headLen = headLen;
+	e->len = len;
+	espFsCacheStats.used += size;
+	espFsCacheStats.files++;
+	espFsClose(file);
+	return true;
+}
+
+// Serve the requested file from the cache, returns false if it has to come from flash
+static bool ICACHE_FLASH_ATTR cacheServe(HttpdConnData *connData) {
+	char etag[12];
+	char acceptEncodingBuffer[64];
+
+	if (++cacheRequests == ESPFS_CACHE_DECAY) {
+		cacheRequests = 0;
+		for (CacheEntry *c = cache; c < cache+ESPFS_CACHE_TRACK; c++) c->count >>= 1;
+	}
+
+	// partial responses come from flash
+	if (httpdGetHeader(connData, "Range", acceptEncodingBuffer, sizeof(acceptEncodingBuffer))) goto miss;
+	CacheEntry *e = cacheFind(connData->url);
+	if (e == NULL) goto miss;
+	if (e->count < 0xffff) e->count++;
+	if (e->data == NULL && (e->noCache || e->count < ESPFS_CACHE_ADMIT ||
+			!cacheLoad(e, connData->url))) goto miss;
+
+	// clients that can't take gzip get the explanation from the regular path
+	if (e->gzip) {
+		httpdGetHeader(connData, "Accept-Encoding", acceptEncodingBuffer, 64);
+		if (os_strstr(acceptEncodingBuffer, "gzip") == NULL) goto miss;
+	}
+	if (httpdETagMatch(connData, e->hash, etag)) {
+		httpdStartResponse(connData, 304);
+		httpdHeader(connData, "ETag", etag);
+		httpdHeader(connData, "Cache-Control", "max-age=3600, must-revalidate");
+		httpdEndHeaders(connData);
+		espFsCacheStats.hits++;
+		return true;
+	}
+	// leave room for what httpdEndHeaders adds to the head
+	if (httpdSendFree(connData) < e->headLen+e->len+128) goto miss;
+	char *head = httpdStartRawResponse(connData, e->headLen);
+	if (head == NULL) goto miss;
+	os_memcpy(head, e->data+e->urlLen, e->headLen);
+	httpdEndHeaders(connData);
+	httpdSend(connData, e->data+e->urlLen+e->headLen, e->len);
+	espFsCacheStats.hits++;
+	return true;
+
+miss:
+	espFsCacheStats.misses++;
+	return false;
+}
+#else
+void ICACHE_FLASH_ATTR espFsCacheFlush(void) {
+}
+#endif
+
 //This is a catch-all cgi function. It takes the url passed to it, looks up the corresponding
 //path in the filesystem and if it exists, passes the file through. This simulates what a normal
 //webserver would do with static files.
 int ICACHE_FLASH_ATTR cgiEspFsHook(HttpdConnData *connData) {
 	EspFsFile *file=connData->cgiData;
-	int len;
-	char buff[1024];
+	int len, want, left;
+	char buff[40];
 	char acceptEncodingBuffer[64];
+	char etag[12];
+	uint32_t hash;
 	int isGzip;
 
 	//os_printf("cgiEspFsHook conn=%p conn->conn=%p file=%p\n", connData, connData->conn, file);
@@ -43,10 +209,31 @@ int ICACHE_FLASH_ATTR cgiEspFsHook(HttpdConnData *connData) {
 	}
 
 	if (file==NULL) {
+#if ESPFS_CACHE_BUDGET > 0
+		if (cacheServe(connData)) return HTTPD_CGI_DONE;
+#endif
 		//First call to this cgi. Open the file so we can read it.
-		file=espFsOpen(connData->url);
+		EspFsOpenResult result;
+		file=espFsOpenStatus(connData->url, &result);
 		if (file==NULL) {
-			return HTTPD_CGI_NOTFOUND;
+			if (result!=ESPFS_OPEN_RESULT_NO_HANDLE) return HTTPD_CGI_NOTFOUND;
+			// The file may well be there, all the handles are busy serving other requests
+			httpdStartResponse(connData, 503);
+			httpdHeader(connData, "Retry-After", "1");
+			httpdEndHeaders(connData);
+			httpdSend(connData, "Busy, try again.\r\n", -1);
+			return HTTPD_CGI_DONE;
+		}
+
+		// If the client already has this version of the file there's no need to read it
+		bool hasHash = espFsHash(file, &hash);
+		if (hasHash && httpdETagMatch(connData, hash, etag)) {
+			espFsClose(file);
+			httpdStartResponse(connData, 304);
+			httpdHeader(connData, "ETag", etag);
+			httpdHeader(connData, "Cache-Control", "max-age=3600, must-revalidate");
+			httpdEndHeaders(connData);
+			return HTTPD_CGI_DONE;
 		}
 
 		// The gzip checking code is intentionally without #ifdefs because checking
@@ -68,20 +255,63 @@ int ICACHE_FLASH_ATTR cgiEspFsHook(HttpdConnData *connData) {
 			}
 		}
 
+		// A range request gets just that part of the file, e.g. to resume a download
+		int size = espFsSize(file), start, end;
+		int range = httpdGetRange(connData, size, hasHash ? etag : NULL, &start, &end);
+		if (range < 0) {
+			espFsClose(file);
+			httpdStartResponse(connData, 416);
+			os_sprintf(buff, "bytes */%d", size);
+			httpdHeader(connData, "Content-Range", buff);
+			httpdEndHeaders(connData);
+			return HTTPD_CGI_DONE;
+		}
+
 		connData->cgiData=file;
-		httpdStartResponse(connData, 200);
-		httpdHeader(connData, "Content-Type", httpdGetMimetype(connData->url));
-		if (isGzip) {
-			httpdHeader(connData, "Content-Encoding", "gzip");
+		connData->cgiPrivData=NULL; // bytes of the range left to send, NULL for the whole file
+		// Send the head mkespfsimage rendered for the file in one go if there is one
+		int headLen = range > 0 ? 0 : espFsHead(file, NULL, 0);
+		char *head = headLen > 0 ? httpdStartRawResponse(connData, headLen) : NULL;
+		if (range > 0) {
+			espFsSeek(file, start);
+			connData->cgiPrivData=(void *)(end-start+1);
+			httpdStartResponse(connData, 206);
+			httpdHeader(connData, "Content-Type", httpdGetMimetype(connData->url));
+			os_sprintf(buff, "%d", end-start+1);
+			httpdHeader(connData, "Content-Length", buff);
+			os_sprintf(buff, "bytes %d-%d/%d", start, end, size);
+			httpdHeader(connData, "Content-Range", buff);
+			if (isGzip) {
+				httpdHeader(connData, "Content-Encoding", "gzip");
+			}
+			httpdHeader(connData, "Cache-Control", "max-age=3600, must-revalidate");
+			if (hasHash) httpdHeader(connData, "ETag", etag);
+		} else if (head != NULL) {
+			espFsHead(file, head, headLen);
+		} else {
+			httpdStartResponse(connData, 200);
+			httpdHeader(connData, "Content-Type", httpdGetMimetype(connData->url));
+			os_sprintf(buff, "%d", size);
+			httpdHeader(connData, "Content-Length", buff);
+			httpdHeader(connData, "Accept-Ranges", "bytes");
+			if (isGzip) {
+				httpdHeader(connData, "Content-Encoding", "gzip");
+			}
+			httpdHeader(connData, "Cache-Control", "max-age=3600, must-revalidate");
+			if (hasHash) httpdHeader(connData, "ETag", etag);
 		}
-		httpdHeader(connData, "Cache-Control", "max-age=3600, must-revalidate");
 		httpdEndHeaders(connData);
-		return HTTPD_CGI_MORE;
 	}
 
-	len=espFsRead(file, buff, 1024);
-	if (len>0) espconn_sent(connData->conn, (uint8 *)buff, len);
-	if (len!=1024) {
+	// Fill the whole send buffer, reading straight from flash into it, so each sent
+	// callback puts close to two full segments on the wire
+	want=httpdSendFree(connData);
+	left=(int)connData->cgiPrivData;
+	if (left>0 && want>left) want=left;
+	len=espFsRead(file, httpdSendPtr(connData), want);
+	httpdSendCommit(connData, len);
+	if (left>0) connData->cgiPrivData=(void *)(left-len);
+	if (len!=want || (left>0 && len==left)) {
 		//We're done.
 		espFsClose(file);
 		return HTTPD_CGI_DONE;
@@ -7,4 +7,15 @@ int cgiEspFsHook(HttpdConnData *connData);
 int ICACHE_FLASH_ATTR cgiEspFsTemplate(HttpdConnData *connData);
 //int ICACHE_FLASH_ATTR cgiEspFsHtml(HttpdConnData *connData);
 
+//RAM cache counters, the cache is there when built with ESPFS_CACHE_BUDGET > 0
+typedef struct {
+	uint32_t hits;     // requests served from RAM
+	uint32_t misses;   // requests served from flash
+	uint16_t used;     // bytes of heap taken by cached files
+	uint16_t budget;   // ESPFS_CACHE_BUDGET
+	uint16_t files;    // files in the cache
+} EspFsCacheStats;
+extern EspFsCacheStats espFsCacheStats;
+void espFsCacheFlush(void);
+
 #endif
@@ -71,7 +71,7 @@ ajaxConsoleBaud(HttpdConnData *connData) {
 	if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
 	char buff[512];
 	int len, status = 400;
-	len = httpdFindArg(connData->getArgs, "rate", buff, sizeof(buff));
+	len = httpdGetArg(connData, "rate", buff, sizeof(buff));
 	if (len > 0) {
 		int rate = atoi(buff);
 		if (rate >= 9600 && rate <= 1000000) {
@@ -89,49 +89,78 @@ ajaxConsoleBaud(HttpdConnData *connData) {
 	return HTTPD_CGI_DONE;
 }
 
+// The console text is streamed straight out of console_buf across HTTPD_CGI_MORE calls.
+// Between calls cgiData holds the number of chars sent (high half) and left to send (low
+// half), cgiPrivData the position the text started at. "len" comes last, it's the number of
+// chars that actually went out: if the uart laps the chars not sent yet, the text ends where
+// it got to.
 int ICACHE_FLASH_ATTR
 ajaxConsole(HttpdConnData *connData) {
 	if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
-	char buff[2048];
+	char buff[256];
+	uint32_t *state = (uint32_t *)&connData->cgiData;
 	int len; // length of text in buff
-	int console_len = (console_wr+BUF_MAX-console_rd) % BUF_MAX; // num chars in console_buf
-	int start = 0; // offset onto console_wr to start sending out chars
-
-	jsonHeader(connData, 200);
+	int rd, left, sent = 0;
 
-	// figure out where to start in buffer based on URI param
-	len = httpdFindArg(connData->getArgs, "start", buff, sizeof(buff));
-	if (len > 0) {
-		start = atoi(buff);
-		if (start < console_pos) {
-			start = 0;
-		} else if (start >= console_pos+console_len) {
-			start = console_len;
-		} else {
-			start = start - console_pos;
+	int console_len = (console_wr+BUF_MAX-console_rd) % BUF_MAX; // num chars in console_buf
+	if (*state == 0) {
+		int start = 0; // offset onto console_wr to start sending out chars
+
+		jsonHeader(connData, 200);
+
+		// figure out where to start in buffer based on URI param
+		len = httpdGetArg(connData, "start", buff, sizeof(buff));
+		if (len > 0) {
+			start = atoi(buff);
+			if (start < console_pos) {
+				start = 0;
+			} else if (start >= console_pos+console_len) {
+				start = console_len;
+			} else {
+				start = start - console_pos;
+			}
 		}
+
+		// start outputting
+		len = os_sprintf(buff, "{\"start\":%d, \"text\": \"", console_pos+start);
+		httpdSend(connData, buff, len);
+		connData->cgiPrivData = (void *)(console_pos+start);
+		rd = (console_rd+start) % BUF_MAX;
+		left = console_len-start;
+	} else {
+		int pos = (int)connData->cgiPrivData;
+		sent = *state >> 16;
+		left = *state & 0xffff;
+		pos += sent;
+		if (pos < console_pos || pos+left > console_pos+console_len) left = 0; // overwritten
+		rd = (console_rd+pos-console_pos) % BUF_MAX;
 	}
 
-	// start outputting
-	len = os_sprintf(buff, "{\"len\":%d, \"start\":%d, \"text\": \"",
-			console_len-start, console_pos+start);
-
-	int rd = (console_rd+start) % BUF_MAX;
-	while (len < 2040 && rd != console_wr) {
-		uint8_t c = console_buf[rd];
-		if (c == '\\' || c == '"') {
-			buff[len++] = '\\';
-			buff[len++] = c;
-		} else if (c == '\r') {
-			// this is crummy, but browsers display a newline for \r\n sequences
-		} else if (c < ' ') {
-			len += os_sprintf(buff+len, "\\u%04x", c);
-		} else {
-			buff[len++] = c;
+	while (left > 0 && httpdSendFree(connData) >= (int)sizeof(buff)) {
+		len = 0;
+		while (left > 0 && len < (int)sizeof(buff)-8) {
+			uint8_t c = console_buf[rd];
+			if (c == '\\' || c == '"') {
+				buff[len++] = '\\';
+				buff[len++] = c;
+			} else if (c == '\r') {
+				// this is crummy, but browsers display a newline for \r\n sequences
+			} else if (c < ' ') {
+				len += os_sprintf(buff+len, "\\u%04x", c);
+			} else {
+				buff[len++] = c;
+			}
+			rd = (rd + 1) % BUF_MAX;
+			left--;
+			sent++;
 		}
-		rd = (rd + 1) % BUF_MAX;
+		httpdSend(connData, buff, len);
+	}
+	if (left > 0) {
+		*state = (sent << 16) | left;
+		return HTTPD_CGI_MORE;
 	}
-	os_strcpy(buff+len, "\"}"); len+=2;
+	len = os_sprintf(buff, "\", \"len\":%d}", sent);
 	httpdSend(connData, buff, len);
 	return HTTPD_CGI_DONE;
 }
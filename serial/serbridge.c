@@ -14,6 +14,7 @@
 #include "config.h"
 #include "console.h"
 #include "tcpclient.h"
+#include "rtclog.h"
 #include "ems.h"
 
 static struct espconn serbridgeConn;
@@ -253,6 +254,9 @@ serbridgeUartCb(char *buf, int length) {
 	}
 	console_write_char('\n');
 
+	// keep the telegram header in RTC memory in case we crash
+	rtclogTelegram(p->sntp_timeStamp, p->buffer, p->writePtr - 2);
+
 	// push the buffer into each open connection
 	if (length > 0) {
 		for (int i = 0; i < MAX_CONN; i++) {
@@ -24,7 +24,8 @@
 #include "uart.h"
 #include "ems.h"
 
-#define recvTaskPrio        0
+// above the httpd task, so web traffic doesn't delay the EMS telegrams
+#define recvTaskPrio        2
 #define recvTaskQueueLen    64
 
 // UartDev is defined and initialized in rom code.
@@ -17,6 +17,7 @@ Some random cgi routines.
 #include <esp8266.h>
 #include "cgi.h"
 #include "espfs.h"
+#include "httpdespfs.h"
 
 void ICACHE_FLASH_ATTR
 jsonHeader(HttpdConnData *connData, int code) {
@@ -57,19 +58,44 @@ extern char *esp_link_version; // in user_main.c
 int ICACHE_FLASH_ATTR cgiMenu(HttpdConnData *connData) {
 	if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
 	char buff[1024];
-	// don't use jsonHeader so the response does get cached
-	httpdStartResponse(connData, 200);
-	httpdHeader(connData, "Cache-Control", "max-age=600, must-revalidate");
-	httpdHeader(connData, "Content-Type", "application/json");
-	httpdEndHeaders(connData);
+	char etag[12];
 	// construct json response
-	os_sprintf(buff,
+	int len = os_sprintf(buff,
 			"{\"menu\": [\"Home\", \"/home.html\","
 			"\"Wifi\", \"/wifi/wifi.html\","
 			"\"EMS Console\", \"/emsconsole.html\","
 			"\"EMS Debug Log\", \"/console.html\","
 			"\"Debug log\", \"/log.html\" ],\n"
 			" \"version\": \"%s\" }", esp_link_version);
-	httpdSend(connData, buff, -1);
+	// don't use jsonHeader so the response does get cached, the ETag lets the browser
+	// revalidate it cheaply
+	bool current = httpdETagMatch(connData, httpdHash(buff, len), etag);
+	httpdStartResponse(connData, current ? 304 : 200);
+	httpdHeader(connData, "Cache-Control", "max-age=600, must-revalidate");
+	httpdHeader(connData, "ETag", etag);
+	if (!current) httpdHeader(connData, "Content-Type", "application/json");
+	httpdEndHeaders(connData);
+	if (!current) httpdSend(connData, buff, len);
+	return HTTPD_CGI_DONE;
+}
+
+// Cgi to return server counters, e.g. for a monitoring script
+int ICACHE_FLASH_ATTR cgiStats(HttpdConnData *connData) {
+	if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
+	char buff[512];
+	int len = os_sprintf(buff,
+			"{\"conn\": {\"accepted\": %u, \"queued\": %u, \"rejected\": %u, "
+			"\"evicted\": %u, \"idleTimeouts\": %u, \"headTimeouts\": %u},\n"
+			" \"espfs\": {\"open\": %u, \"maxOpen\": %u, \"handles\": %u, \"exhausted\": %u},\n"
+			" \"cache\": {\"hits\": %u, \"misses\": %u, \"files\": %u, \"used\": %u, \"budget\": %u},\n"
+			" \"heap\": %u, \"uptime\": %u }",
+			httpdStats.accepted, httpdStats.queued, httpdStats.rejected,
+			httpdStats.evicted, httpdStats.idleTimeouts, httpdStats.headTimeouts,
+			espFsStats.open, espFsStats.maxOpen, ESPFS_MAX_HANDLES, espFsStats.exhausted,
+			espFsCacheStats.hits, espFsCacheStats.misses, espFsCacheStats.files,
+			espFsCacheStats.used, espFsCacheStats.budget,
+			system_get_free_heap_size(), system_get_time()/1000000);
+	jsonHeader(connData, 200);
+	httpdSend(connData, buff, len);
 	return HTTPD_CGI_DONE;
 }
@@ -5,5 +5,6 @@
 
 void jsonHeader(HttpdConnData *connData, int code);
 int cgiMenu(HttpdConnData *connData);
+int cgiStats(HttpdConnData *connData);
 
 #endif
@@ -17,7 +17,10 @@ Some flash handling cgi routines. Used for reading the existing flash and updati
 #include <esp8266.h>
 #include <osapi.h>
 #include "cgiflash.h"
+#include "cgi.h"
 #include "espfs.h"
+#include "espfsformat.h"
+#include "httpdespfs.h"
 
 // Check that the header of the firmware blob looks like actual firmware...
 static char* ICACHE_FLASH_ATTR check_header(void *buf) {
@@ -178,3 +181,195 @@ int ICACHE_FLASH_ATTR cgiRebootFirmware(HttpdConnData *connData) {
 	os_timer_arm(&flash_reboot_timer, 2000, 1);
 	return HTTPD_CGI_DONE;
 }
+
+#ifdef ESPFS_PARTITION
+//===== Web pages in their own flash partition, so they can be updated without a new firmware
+
+// The espfs partition at ESPFS_PARTITION has two slots of ESPFS_SLOT_SIZE. The first sector of a
+// slot holds an EspFsSlot record, the espfs image starts in the next sector. An upload goes into
+// the slot that isn't mounted and writes the record last, once the image checks out, so a slot
+// is either complete or gets ignored. The valid slot with the highest seq gets mounted.
+#define ESPFS_SLOT_MAGIC 0x544c5345 // "ESLT"
+#define ESPFS_SLOT_DATA SPI_FLASH_SEC_SIZE
+#define ESPFS_SLOT_MAX (ESPFS_SLOT_SIZE-ESPFS_SLOT_DATA)
+#define UPLOAD_FAILED ((void *)1)
+
+typedef struct {
+	uint32_t magic;
+	uint32_t seq;
+	uint32_t len;  // of the image
+	uint32_t hash; // FNV-1a of the image
+} EspFsSlot;
+
+typedef struct {
+	int slot;
+	uint32_t hash; // of the data received so far
+	char *sector;  // the sector being received
+} EspFsUpload;
+
+static int espFsSlot = -1; // mounted slot, -1 for the image linked into the firmware
+static uint32_t espFsSeq;  // of the mounted slot
+
+static uint32_t ICACHE_FLASH_ATTR slotAddr(int slot) {
+	return ESPFS_PARTITION + slot*ESPFS_SLOT_SIZE;
+}
+
+static uint32_t ICACHE_FLASH_ATTR fnvHash(uint32_t hash, uint8_t *data, int len) {
+	for (int i=0; i<len; i++) hash = (hash^data[i])*16777619u;
+	return hash;
+}
+
+// Hash len bytes of flash at addr
+static uint32_t ICACHE_FLASH_ATTR flashHash(uint32_t addr, int len) {
+	uint32_t buf[64];
+	uint32_t hash = 2166136261u;
+	for (int off=0; off<len; off+=sizeof(buf)) {
+		int n = len-off < sizeof(buf) ? len-off : sizeof(buf);
+		spi_flash_read(addr+off, buf, (n+3)&~3);
+		hash = fnvHash(hash, (uint8_t *)buf, n);
+	}
+	return hash;
+}
+
+// Read the record of a slot, returns false if the slot doesn't hold a complete image
+static bool ICACHE_FLASH_ATTR slotValid(int slot, EspFsSlot *s) {
+	spi_flash_read(slotAddr(slot), (uint32 *)s, sizeof(EspFsSlot));
+	if (s->magic != ESPFS_SLOT_MAGIC || s->len > ESPFS_SLOT_MAX) return false;
+	return flashHash(slotAddr(slot)+ESPFS_SLOT_DATA, s->len) == s->hash;
+}
+
+// Mount the newest valid image in the espfs partition, returns false if there is none and the
+// image linked into the firmware should be used
+bool ICACHE_FLASH_ATTR espFsMountPartition(void) {
+	EspFsSlot s[2];
+	bool valid[2];
+	for (int i=0; i<2; i++) valid[i] = slotValid(i, &s[i]);
+	int slot = valid[0] && (!valid[1] || s[0].seq > s[1].seq) ? 0 : valid[1] ? 1 : -1;
+	if (slot < 0) return false;
+	if (espFsInit((void *)(slotAddr(slot)+ESPFS_SLOT_DATA)) != ESPFS_INIT_RESULT_OK) return false;
+	espFsSlot = slot;
+	espFsSeq = s[slot].seq;
+	os_printf("Espfs: slot %d seq %ld, %ld bytes\n", slot, s[slot].seq, s[slot].len);
+	return true;
+}
+
+static int ICACHE_FLASH_ATTR uploadError(HttpdConnData *connData, int code, char *err) {
+	EspFsUpload *up = connData->cgiPrivData;
+	if (up != NULL && up != UPLOAD_FAILED) {
+		os_free(up->sector);
+		os_free(up);
+	}
+	connData->cgiPrivData = UPLOAD_FAILED;
+	os_printf("Error %d: %s\n", code, err);
+	httpdStartResponse(connData, code);
+	httpdHeader(connData, "Content-Type", "text/plain");
+	httpdEndHeaders(connData);
+	httpdSend(connData, err, -1);
+	httpdSend(connData, "\r\n", -1);
+	return HTTPD_CGI_DONE;
+}
+
+//===== Cgi that takes a new espfs image via http POST and switches to it once it's written.
+// Each sector gets erased when its first data arrives and written once it's complete.
+int ICACHE_FLASH_ATTR cgiUploadEspFs(HttpdConnData *connData) {
+	EspFsUpload *up = connData->cgiPrivData;
+	if (connData->conn==NULL) {
+		// Connection aborted. Clean up, the slot stays invalid.
+		if (up != NULL && up != UPLOAD_FAILED) {
+			os_free(up->sector);
+			os_free(up);
+		}
+		connData->cgiPrivData = NULL;
+		return HTTPD_CGI_DONE;
+	}
+
+	HttpdPostData *post = connData->post;
+	int offset = post->received - post->buffLen;
+	if (offset == 0) {
+		uint32_t magic = 0;
+		up = connData->cgiPrivData = NULL;
+		if (post->buff == NULL || connData->requestType != HTTPD_METHOD_POST ||
+				post->buffLen < sizeof(magic))
+			return uploadError(connData, 400, "Invalid request");
+		if (post->len > ESPFS_SLOT_MAX)
+			return uploadError(connData, 400, "Espfs image too large");
+		os_memcpy(&magic, post->buff, sizeof(magic));
+		if (magic != ESPFS_MAGIC && magic != ESPFS_MAGIC_V2)
+			return uploadError(connData, 400, "Not an espfs image");
+
+		up = os_malloc(sizeof(EspFsUpload));
+		if (up != NULL) up->sector = os_malloc(SPI_FLASH_SEC_SIZE);
+		if (up == NULL || up->sector == NULL) {
+			if (up != NULL) os_free(up);
+			return uploadError(connData, 503, "Out of memory");
+		}
+		connData->cgiPrivData = up;
+		up->slot = espFsSlot == 0 ? 1 : 0;
+		up->hash = 2166136261u;
+		// invalidate the slot first, a partial upload must not get mounted
+		os_printf("Espfs upload into slot %d, %d bytes\n", up->slot, post->len);
+		spi_flash_erase_sector(slotAddr(up->slot)/SPI_FLASH_SEC_SIZE);
+	} else if (up == UPLOAD_FAILED || up == NULL) {
+		// we already responded with an error, drop the rest
+		return HTTPD_CGI_DONE;
+	}
+
+	int pos = offset % SPI_FLASH_SEC_SIZE;
+	uint32_t address = slotAddr(up->slot) + ESPFS_SLOT_DATA + offset - pos;
+	if (pos + post->buffLen > SPI_FLASH_SEC_SIZE)
+		return uploadError(connData, 500, "Buffering problem");
+
+	// erase the sector ahead of filling it
+	if (pos == 0) spi_flash_erase_sector(address/SPI_FLASH_SEC_SIZE);
+	os_memcpy(up->sector+pos, post->buff, post->buffLen);
+	up->hash = fnvHash(up->hash, (uint8_t *)post->buff, post->buffLen);
+	pos += post->buffLen;
+
+	bool last = post->received == post->len;
+	if (pos == SPI_FLASH_SEC_SIZE || last) {
+		while (pos & 3) up->sector[pos++] = 0xff;
+		if (spi_flash_write(address, (uint32 *)up->sector, pos) != SPI_FLASH_RESULT_OK)
+			return uploadError(connData, 500, "Flash write failed");
+	}
+	if (!last) return HTTPD_CGI_MORE;
+
+	// read it back and make sure it's what was sent
+	uint32_t data = slotAddr(up->slot) + ESPFS_SLOT_DATA;
+	if (flashHash(data, post->len) != up->hash)
+		return uploadError(connData, 500, "Verifying the flash failed");
+	// and that it can be mounted, a broken image must not get committed, it would be mounted
+	// at every boot in place of the one in the firmware
+	if (espFsCheck((void *)data, post->len) != ESPFS_INIT_RESULT_OK)
+		return uploadError(connData, 400, "Broken espfs image");
+
+	// commit: write the record, with a seq above both slots
+	EspFsSlot s, other;
+	s.magic = ESPFS_SLOT_MAGIC;
+	s.seq = espFsSeq;
+	spi_flash_read(slotAddr(1-up->slot), (uint32 *)&other, sizeof(other));
+	if (other.magic == ESPFS_SLOT_MAGIC && other.seq > s.seq) s.seq = other.seq;
+	s.seq++;
+	s.len = post->len;
+	s.hash = up->hash;
+	if (spi_flash_write(slotAddr(up->slot), (uint32 *)&s, sizeof(s)) != SPI_FLASH_RESULT_OK)
+		return uploadError(connData, 500, "Flash write failed");
+
+	// and switch over, files being served from the old slot can still be read to the end
+	espFsCacheFlush();
+	if (espFsInit((void *)data) != ESPFS_INIT_RESULT_OK)
+		return uploadError(connData, 500, "Mounting the image failed");
+	espFsSlot = up->slot;
+	espFsSeq = s.seq;
+	os_printf("Espfs: slot %d seq %ld mounted\n", espFsSlot, espFsSeq);
+
+	char buff[96];
+	int len = os_sprintf(buff, "{\"slot\": %d, \"seq\": %ld, \"len\": %ld, \"hash\": \"%08lx\"}",
+			espFsSlot, s.seq, s.len, s.hash);
+	os_free(up->sector);
+	os_free(up);
+	connData->cgiPrivData = NULL;
+	jsonHeader(connData, 200);
+	httpdSend(connData, buff, len);
+	return HTTPD_CGI_DONE;
+}
+#endif
@@ -7,5 +7,9 @@ int cgiReadFlash(HttpdConnData *connData);
 int cgiGetFirmwareNext(HttpdConnData *connData);
 int cgiUploadFirmware(HttpdConnData *connData);
 int cgiRebootFirmware(HttpdConnData *connData);
+#ifdef ESPFS_PARTITION
+int cgiUploadEspFs(HttpdConnData *connData);
+bool espFsMountPartition(void);
+#endif
 
 #endif
@@ -74,7 +74,7 @@ int ICACHE_FLASH_ATTR cgiPinsSet(HttpdConnData *connData) {
   }
 
   char buff[128];
-  int len = httpdFindArg(connData->getArgs, "map", buff, sizeof(buff));
+  int len = httpdGetArg(connData, "map", buff, sizeof(buff));
   if (len <= 0) {
     jsonHeader(connData, 400);
     return HTTPD_CGI_DONE;
@@ -28,7 +28,7 @@ int ICACHE_FLASH_ATTR cgiTcpSet(HttpdConnData *connData) {
 
   // Handle tcp_enable flag
   char buff[128];
-  int len = httpdFindArg(connData->getArgs, "tcp_enable", buff, sizeof(buff));
+  int len = httpdGetArg(connData, "tcp_enable", buff, sizeof(buff));
   if (len <= 0) {
     jsonHeader(connData, 400);
     return HTTPD_CGI_DONE;
@@ -36,7 +36,7 @@ int ICACHE_FLASH_ATTR cgiTcpSet(HttpdConnData *connData) {
   flashConfig.tcp_enable = os_strcmp(buff, "true") == 0;
 
   // Handle rssi_enable flag
-  len = httpdFindArg(connData->getArgs, "rssi_enable", buff, sizeof(buff));
+  len = httpdGetArg(connData, "rssi_enable", buff, sizeof(buff));
   if (len <= 0) {
     jsonHeader(connData, 400);
     return HTTPD_CGI_DONE;
@@ -44,7 +44,7 @@ int ICACHE_FLASH_ATTR cgiTcpSet(HttpdConnData *connData) {
   flashConfig.rssi_enable = os_strcmp(buff, "true") == 0;
 
   // Handle api_key flag
-  len = httpdFindArg(connData->getArgs, "api_key", buff, sizeof(buff));
+  len = httpdGetArg(connData, "api_key", buff, sizeof(buff));
   if (len < 0) {
     jsonHeader(connData, 400);
   return HTTPD_CGI_DONE;
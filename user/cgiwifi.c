@@ -100,6 +100,7 @@ typedef struct {
 	char scanInProgress; //if 1, don't access the underlying stuff from the webpage.
 	ApData **apData;
 	int noAps;
+	int scanSeq; //bumped every time apData gets replaced
 } ScanResultData;
 
 //Static scan status storage.
@@ -155,6 +156,7 @@ void ICACHE_FLASH_ATTR wifiScanDoneCb(void *arg, STATUS status) {
 		n++;
 	}
 	//We're done.
+	cgiWifiAps.scanSeq++;
 	cgiWifiAps.scanInProgress=0;
 }
 
@@ -176,29 +178,42 @@ static int ICACHE_FLASH_ATTR cgiWiFiStartScan(HttpdConnData *connData) {
 	return HTTPD_CGI_DONE;
 }
 
+// The AP list is streamed across HTTPD_CGI_MORE calls, cgiData holds the index of the next
+// AP to send plus one and cgiPrivData the scan it comes from. If a newer scan replaces the
+// list in between, the response ends with the APs sent so far.
 static int ICACHE_FLASH_ATTR cgiWiFiGetScan(HttpdConnData *connData) {
 	if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
-	char buff[2048];
+	char buff[256];
+	int *pos = (int *)&connData->cgiData;
 	int len;
 
-	jsonHeader(connData, 200);
+	if (*pos == 0) {
+		jsonHeader(connData, 200);
+
+		if (cgiWifiAps.scanInProgress==1) {
+			//We're still scanning. Tell Javascript code that.
+			len = os_sprintf(buff, "{\n \"result\": { \n\"inProgress\": \"1\"\n }\n}\n");
+			httpdSend(connData, buff, len);
+			return HTTPD_CGI_DONE;
+		}
 
-	if (cgiWifiAps.scanInProgress==1) {
-		//We're still scanning. Tell Javascript code that.
-		len = os_sprintf(buff, "{\n \"result\": { \n\"inProgress\": \"1\"\n }\n}\n");
+		len = os_sprintf(buff, "{\"result\": {\"inProgress\": \"0\", \"APs\": [\n");
 		httpdSend(connData, buff, len);
-		return HTTPD_CGI_DONE;
+		*pos = 1;
+		connData->cgiPrivData = (void *)cgiWifiAps.scanSeq;
+	} else if ((int)connData->cgiPrivData != cgiWifiAps.scanSeq) {
+		*pos = cgiWifiAps.noAps+1; // the list changed under us
 	}
 
-	len = os_sprintf(buff, "{\"result\": {\"inProgress\": \"0\", \"APs\": [\n");
-	for (int pos=0; pos<cgiWifiAps.noAps; pos++) {
-		len += os_sprintf(buff+len, "{\"essid\": \"%s\", \"rssi\": %d, \"enc\": \"%d\"}%s\n",
-				cgiWifiAps.apData[pos]->ssid, cgiWifiAps.apData[pos]->rssi,
-				cgiWifiAps.apData[pos]->enc, (pos==cgiWifiAps.noAps-1)?"":",");
+	for (; *pos-1 < cgiWifiAps.noAps; (*pos)++) {
+		if (httpdSendFree(connData) < (int)sizeof(buff)) return HTTPD_CGI_MORE;
+		int i = *pos-1;
+		len = os_sprintf(buff, "%s{\"essid\": \"%s\", \"rssi\": %d, \"enc\": \"%d\"}\n",
+				i==0 ? "" : ",", cgiWifiAps.apData[i]->ssid, cgiWifiAps.apData[i]->rssi,
+				cgiWifiAps.apData[i]->enc);
+		httpdSend(connData, buff, len);
 	}
-	len += os_sprintf(buff+len, "]}}\n");
-	//os_printf("Sending %d bytes: %s\n", len, buff);
-	httpdSend(connData, buff, len);
+	httpdSend(connData, "]}}\n", -1);
 	return HTTPD_CGI_DONE;
 }
 
@@ -276,8 +291,8 @@ int ICACHE_FLASH_ATTR cgiWiFiConnect(HttpdConnData *connData) {
 
 	if (connData->conn==NULL) return HTTPD_CGI_DONE;
 
-	int el = httpdFindArg(connData->getArgs, "essid", essid, sizeof(essid));
-	int pl = httpdFindArg(connData->getArgs, "passwd", passwd, sizeof(passwd));
+	int el = httpdGetArg(connData, "essid", essid, sizeof(essid));
+	int pl = httpdGetArg(connData, "passwd", passwd, sizeof(passwd));
 
 	if (el > 0 && pl >= 0) {
 		//Set to 0 if you want to disable the actual reconnecting bit
@@ -372,11 +387,11 @@ int ICACHE_FLASH_ATTR cgiWiFiSpecial(HttpdConnData *connData) {
 	if (connData->conn==NULL) return HTTPD_CGI_DONE;
 
 	// get args and their string lengths
-	int dl = httpdFindArg(connData->getArgs, "dhcp", dhcp, sizeof(dhcp));
-	int hl = httpdFindArg(connData->getArgs, "hostname", hostname, sizeof(hostname));
-	int sl = httpdFindArg(connData->getArgs, "staticip", staticip, sizeof(staticip));
-	int nl = httpdFindArg(connData->getArgs, "netmask", netmask, sizeof(netmask));
-	int gl = httpdFindArg(connData->getArgs, "gateway", gateway, sizeof(gateway));
+	int dl = httpdGetArg(connData, "dhcp", dhcp, sizeof(dhcp));
+	int hl = httpdGetArg(connData, "hostname", hostname, sizeof(hostname));
+	int sl = httpdGetArg(connData, "staticip", staticip, sizeof(staticip));
+	int nl = httpdGetArg(connData, "netmask", netmask, sizeof(netmask));
+	int gl = httpdGetArg(connData, "gateway", gateway, sizeof(gateway));
 
 	if (!(dl > 0 && hl >= 0 && sl >= 0 && nl >= 0 && gl >= 0)) {
 		jsonHeader(connData, 400);
@@ -435,9 +450,9 @@ int ICACHE_FLASH_ATTR cgiWiFiEMSSetting(HttpdConnData *connData) {
 	char timezone[4];
 	char collectord[32];
 
-	int nl = httpdFindArg(connData->getArgs, "ntpserver", ntpserver, sizeof(ntpserver));
-	int tl = httpdFindArg(connData->getArgs, "timezone", timezone, sizeof(timezone));
-	int cl = httpdFindArg(connData->getArgs, "collectord", collectord, sizeof(collectord));
+	int nl = httpdGetArg(connData, "ntpserver", ntpserver, sizeof(ntpserver));
+	int tl = httpdGetArg(connData, "timezone", timezone, sizeof(timezone));
+	int cl = httpdGetArg(connData, "collectord", collectord, sizeof(collectord));
 
 	flashConfig.timezone = tl ? atoi(timezone) : 0;
 	os_strcpy(flashConfig.ntp_server, nl ? ntpserver : "");
@@ -466,7 +481,7 @@ int ICACHE_FLASH_ATTR cgiWiFiSetMode(HttpdConnData *connData) {
 
 	if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
 
-	len=httpdFindArg(connData->getArgs, "mode", buff, sizeof(buff));
+	len=httpdGetArg(connData, "mode", buff, sizeof(buff));
 	if (len!=0) {
 		int m = atoi(buff);
 		os_printf("Wifi switching to mode %d\n", m);
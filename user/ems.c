@@ -25,6 +25,8 @@
 #include "sntp.h"
 #include "ems.h"
 #include "config.h"
+#include "cgi.h"
+#include "emscapture.h"
 
 uint8_t	EMSBusBusy  = false;
 uint8_t	EMSInitDone = false;
@@ -56,10 +58,153 @@ void ICACHE_FLASH_ATTR emsInit(void) {
     emsSNTPReInit();            // (re)init SNTP system
 }
 
+// === EMS state ===
+// Values decoded from the bus for the Home page. A global version counter is bumped whenever
+// a value changes and each value remembers the version at which it last changed, so a client
+// can ask for just the values changed since its previous poll.
+typedef struct {
+    const char	*name;
+    int32_t	value;
+    uint32_t	version;	// emsStateVersion at last change, 0 = never received
+} _EMSStateField;
+
+enum {
+    EMS_TIME, EMS_UPTIME, EMS_RUNTIME, EMS_NEXTSERVICE, EMS_HEATING, EMS_OUTDOORTEMP,
+    EMS_WATERTEMP, EMS_FLOWTEMP, EMS_BOILERTEMP, EMS_WWTEMP, EMS_PRESSURE, EMS_STARTS,
+    EMS_NUMFIELDS
+};
+
+static _EMSStateField emsState[EMS_NUMFIELDS] = {
+    { "time" },		// RC time of day in seconds
+    { "uptime" },	// total operating time in minutes
+    { "runtime" },	// heating operating time in minutes
+    { "nextservice" },	// operating hours before service in 100h
+    { "heating" },	// gas valve on
+    { "outdoortemp" },	// temperatures in 1/10 degC
+    { "watertemp" },
+    { "flowtemp" },
+    { "boilertemp" },
+    { "wwtemp" },
+    { "pressure" },	// system pressure in 1/10 bar
+    { "starts" },	// burner starts
+};
+static uint32_t emsStateVersion;
+
+static void ICACHE_FLASH_ATTR emsSetField(int field, int32_t value) {
+    _EMSStateField *f = &emsState[field];
+    if (f->version != 0 && f->value == value) return;
+    f->value = value;
+    f->version = ++emsStateVersion;
+}
+
+// Fetch the big-endian value of n bytes at position pos of the telegram's message struct.
+// Telegrams may carry only a fragment of the struct starting at their offset byte, returns
+// false if the fragment does not cover the value.
+static bool ICACHE_FLASH_ATTR emsGet(char *buf, int len, int pos, int n, int32_t *value) {
+    int offset = (uint8_t)buf[3];
+    // 4 header bytes (src, dst, type, offset), data, 1 crc byte
+    if (pos < offset || pos+n > offset + len-5) return false;
+    uint8_t *d = (uint8_t *)buf + 4 + pos-offset;
+    int32_t v = 0;
+    for (int i=0; i<n; i++) v = (v << 8) | d[i];
+    *value = v;
+    return true;
+}
+
+// temperatures are signed 16-bit in 1/10 degC, 0x8000 if the sensor is missing
+static void ICACHE_FLASH_ATTR emsSetTemp(int field, char *buf, int len, int pos) {
+    int32_t v;
+    if (emsGet(buf, len, pos, 2, &v) && v != 0x8000) emsSetField(field, (int16_t)v);
+}
+
+static void ICACHE_FLASH_ATTR emsSetValue(int field, char *buf, int len, int pos, int n) {
+    int32_t v;
+    if (emsGet(buf, len, pos, n, &v)) emsSetField(field, v);
+}
+
+// EMS crc as documented for the bus, computed over the len-1 bytes before the crc byte
+uint8_t ICACHE_FLASH_ATTR EMSCrc(const char *buf, int len) {
+    uint8_t crc = 0;
+    for (int i=0; i<len-1; i++) {
+	uint8_t d = 0;
+	if (crc & 0x80) {
+	    crc ^= 0x0c;
+	    d = 1;
+	}
+	crc = (crc << 1) | d;
+	crc ^= buf[i];
+    }
+    return crc;
+}
+
 // simple interface for EMS
 void ICACHE_FLASH_ATTR emsRxHandler(_EMSRxBuf *rxBuf) {
-//    void *emsData = (void *)&rxBuf->buffer;
+    char *buf = rxBuf->buffer;
+    int len = rxBuf->writePtr - 2;	// strip the break marker appended by the uart
+    if (len < 6) return;		// header, at least one data byte and crc
+    if (EMSCrc(buf, len) != (uint8_t)buf[len-1]) return;	// corrupted on the bus
 
     // pick most interesting data for EMS overview
+    int32_t v;
+    switch ((uint8_t)buf[2]) {
+    case 0x06:	// RCTime
+	if (emsGet(buf, len, offsetof(_EMSRCTimeMessage, hours), 1, &v) && v < 24) {
+	    int32_t mins, secs;
+	    if (emsGet(buf, len, offsetof(_EMSRCTimeMessage, minutes), 1, &mins) &&
+		    emsGet(buf, len, offsetof(_EMSRCTimeMessage, seconds), 1, &secs))
+		emsSetField(EMS_TIME, v*3600 + mins*60 + secs);
+	}
+	break;
+    case 0x15:	// UBAWartungsdaten
+	emsSetValue(EMS_NEXTSERVICE, buf, len, offsetof(_EMSUBAWartungsdaten, pending), 1);
+	break;
+    case 0x18:	// UBAMonitorFast
+	emsSetTemp(EMS_FLOWTEMP, buf, len, offsetof(_EMSUBAMonitorFast, vtist));
+	emsSetTemp(EMS_WATERTEMP, buf, len, offsetof(_EMSUBAMonitorFast, rltemp));
+	// the burner bits sit in the byte before res3, bit 0 is the gas valve
+	if (emsGet(buf, len, offsetof(_EMSUBAMonitorFast, res3)-1, 1, &v))
+	    emsSetField(EMS_HEATING, v & 1);
+	if (emsGet(buf, len, offsetof(_EMSUBAMonitorFast, pressure), 1, &v) && v != 0xff)
+	    emsSetField(EMS_PRESSURE, v);
+	break;
+    case 0x19:	// UBAMonitorSlow
+	emsSetTemp(EMS_OUTDOORTEMP, buf, len, offsetof(_EMSUBAMonitorSlow, outdoortemp));
+	emsSetTemp(EMS_BOILERTEMP, buf, len, offsetof(_EMSUBAMonitorSlow, ktemp));
+	emsSetValue(EMS_STARTS, buf, len, offsetof(_EMSUBAMonitorSlow, starts), 3);
+	emsSetValue(EMS_UPTIME, buf, len, offsetof(_EMSUBAMonitorSlow, betriebszeit), 3);
+	emsSetValue(EMS_RUNTIME, buf, len, offsetof(_EMSUBAMonitorSlow, heizzeit), 3);
+	break;
+    case 0x34:	// UBAMonitorWWMessage
+	emsSetTemp(EMS_WWTEMP, buf, len, offsetof(_EMSUBAMonitorWWMessage, wwist));
+	break;
+    }
+}
+
+// uart receive callback, buf is the _EMSRxBuf that just completed
+void ICACHE_FLASH_ATTR emsUartCb(char *buf, int len) {
+    emsCaptureAdd((_EMSRxBuf *)buf);
+    emsRxHandler((_EMSRxBuf *)buf);
+}
+
+// Return the decoded EMS state as one JSON object. With since=<version> only the values that
+// changed after that version are included; a version from before a reboot gets everything.
+int ICACHE_FLASH_ATTR ajaxEmsState(HttpdConnData *connData) {
+    if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
+    char buff[512];
+    uint32_t since = 0;
+
+    if (httpdGetArg(connData, "since", buff, sizeof(buff)) > 0)
+	since = atoi(buff);
+    if (since > emsStateVersion) since = 0;
+
+    int len = os_sprintf(buff, "{\"version\":%lu", (unsigned long)emsStateVersion);
+    for (int i=0; i<EMS_NUMFIELDS; i++) {
+	if (emsState[i].version > since)
+	    len += os_sprintf(buff+len, ",\"%s\":%ld", emsState[i].name, (long)emsState[i].value);
+    }
+    len += os_sprintf(buff+len, "}");
 
+    jsonHeader(connData, 200);
+    httpdSend(connData, buff, len);
+    return HTTPD_CGI_DONE;
 }
@@ -17,6 +17,10 @@
  */
 
 #ifndef __EMS_H
+#define __EMS_H
+
+#include "httpd.h"
+
 #define EMS_MAXBUFFERS		4
 #define EMS_MAXBUFFERSIZE	128
 
@@ -359,9 +363,11 @@ extern _EMSRxBuf *paEMSRxBuf[EMS_MAXBUFFERS];
 extern uint8_t	EMSBusBusy;
 extern uint8_t	EMSInitDone;
 
-uint8_t ICACHE_FLASH_ATTR EMSCrc(void);
+uint8_t ICACHE_FLASH_ATTR EMSCrc(const char *buf, int len);
 void ICACHE_FLASH_ATTR emsInit(void);
 void ICACHE_FLASH_ATTR emsSNTPReInit(void);
 void ICACHE_FLASH_ATTR emsRxHandler(_EMSRxBuf *rxBuf);
+void ICACHE_FLASH_ATTR emsUartCb(char *buf, int len);
+int ajaxEmsState(HttpdConnData *connData);
 
 #endif
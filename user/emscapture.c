@@ -0,0 +1,321 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <esp8266.h>
+#include "cgi.h"
+#include "emscapture.h"
+
+// Telegram capture: every telegram received from the bus is kept in a RAM ring together with
+// its time stamps and a sequence number. /ems/capture streams the ring as a compact binary
+// capture for offline analysis, /ems/capture?since=<seq> or ?time=<sntp secs> returns only
+// the newer telegrams so a cron job can pull incremental captures. &end=<seq> stops before
+// that record, the ETag names the records a capture holds and Range requests get part of it,
+// so an interrupted download can be resumed. Sequence numbers start over at every boot, so the
+// ETag and the file header carry a random boot id that tells the captures of two boots apart.
+//
+// Capture format, all values little endian:
+//   file header: "EMSC", u8 version (2), u8 header length (20), u16 reserved,
+//                u32 sequence of the first record, u32 sequence following the last record,
+//                u32 boot id
+//   record:      u16 ms since the previous record, u8 length, u8 status,
+//                [u32 sequence if CAP_GAP], [u32 sntp time if CAP_TIME], payload
+// Records are numbered consecutively from the first sequence; CAP_GAP marks records that
+// follow telegrams which were overwritten in the ring while the capture was being streamed.
+// The capture ends when the connection closes. A Range response whose records got overwritten
+// before they were sent is aborted: the connection gets closed without ending the response.
+
+#define CAP_RINGSIZE  4096        // bytes of telegram history kept
+#define CAP_CHUNK     1024        // bytes of records sent per cgi call
+#define CAP_VERSION   2
+#define CAP_HDRLEN    20          // file header length
+
+// record status bits
+#define CAP_CRCOK     0x01        // telegram crc is correct
+#define CAP_TIME      0x02        // absolute sntp time follows, ms delta is 0
+#define CAP_GAP       0x04        // records were lost before this one, sequence follows
+#define CAP_SHORT     0x08        // single byte (poll or echo), no crc
+
+#pragma pack(1)
+typedef struct {
+	uint32_t sntp_timeStamp;      // seconds
+	uint32_t sys_timeStamp;       // microseconds, free running
+	uint8_t  len;
+	uint8_t  status;
+} CapRecord;
+#pragma pack()
+
+// Invariants: records are stored back to back starting at capHead and wrap around the end
+// of the ring, capUsed bytes are in use, the oldest record has sequence number capFirstSeq
+// and the next one to be added gets capNextSeq.
+static uint8_t  capRing[CAP_RINGSIZE];
+static uint16_t capHead, capUsed;
+static uint32_t capFirstSeq, capNextSeq;
+static uint32_t capBoot;          // random, picked at the first capture request
+
+static void ICACHE_FLASH_ATTR
+capCopy(int off, void *dst, int len, bool write) {
+	while (len > 0) {
+		int n = CAP_RINGSIZE - off;
+		if (n > len) n = len;
+		if (write) os_memcpy(capRing+off, dst, n);
+		else os_memcpy(dst, capRing+off, n);
+		dst = (char *)dst + n;
+		len -= n;
+		off = 0;
+	}
+}
+
+static int ICACHE_FLASH_ATTR
+capNext(int off, CapRecord *r) {
+	return (off + sizeof(CapRecord) + r->len) % CAP_RINGSIZE;
+}
+
+// Add a received telegram to the ring, dropping the oldest ones to make room
+void ICACHE_FLASH_ATTR
+emsCaptureAdd(_EMSRxBuf *rxBuf) {
+	int len = rxBuf->writePtr - 2;    // strip the break marker appended by the uart
+	if (len <= 0) return;
+	if (len > 255) len = 255;
+
+	CapRecord r;
+	r.sntp_timeStamp = rxBuf->sntp_timeStamp;
+	r.sys_timeStamp = rxBuf->sys_timeStamp;
+	r.len = len;
+	if (len == 1) r.status = CAP_SHORT;
+	else r.status = EMSCrc(rxBuf->buffer, len) == (uint8_t)rxBuf->buffer[len-1] ? CAP_CRCOK : 0;
+
+	int need = sizeof(CapRecord) + len;
+	while (capUsed > 0 && capUsed + need > CAP_RINGSIZE) {
+		CapRecord old;
+		capCopy(capHead, &old, sizeof(CapRecord), false);
+		capHead = capNext(capHead, &old);
+		capUsed -= sizeof(CapRecord) + old.len;
+		capFirstSeq++;
+	}
+
+	int off = (capHead + capUsed) % CAP_RINGSIZE;
+	capCopy(off, &r, sizeof(CapRecord), true);
+	capCopy((off + sizeof(CapRecord)) % CAP_RINGSIZE, rxBuf->buffer, len, true);
+	capUsed += need;
+	capNextSeq++;
+}
+
+// Streaming state kept in cgiData between calls
+typedef struct {
+	uint32_t seq;                 // next record to send
+	uint32_t endSeq;              // sequence following the last record to send
+	uint16_t off;                 // ring offset of record seq, valid while seq >= capFirstSeq
+	uint32_t lastSys;             // sys time stamp of the previous record sent
+	bool     started;             // at least one record has been sent
+	uint32_t skip;                // bytes of the capture to drop before a requested range
+	int32_t  left;                // bytes of the range left to send, -1 without a range
+} CapStream;
+
+// Build the header of the record at st->off, returns its length
+static int ICACHE_FLASH_ATTR
+capRecordHeader(CapStream *st, CapRecord *r, bool gap, uint8_t *hdr) {
+	int hl = 4;
+	uint32_t delta = (r->sys_timeStamp - st->lastSys) / 1000;
+	uint8_t status = r->status;
+	if (!st->started || delta > 0xffff) {
+		status |= CAP_TIME;
+		delta = 0;
+	}
+	if (gap) status |= CAP_GAP;
+	hdr[0] = delta & 0xff;
+	hdr[1] = delta >> 8;
+	hdr[2] = r->len;
+	hdr[3] = status;
+	if (gap) {
+		os_memcpy(hdr+hl, &st->seq, 4);
+		hl += 4;
+	}
+	if (status & CAP_TIME) {
+		os_memcpy(hdr+hl, &r->sntp_timeStamp, 4);
+		hl += 4;
+	}
+	return hl;
+}
+
+// Send part of the capture, dropping what comes before the requested range and stopping at
+// its end. Returns the number of bytes that went out.
+static int ICACHE_FLASH_ATTR
+capSend(HttpdConnData *connData, CapStream *st, char *data, int len) {
+	if (st->skip >= len) {
+		st->skip -= len;
+		return 0;
+	}
+	data += st->skip;
+	len -= st->skip;
+	st->skip = 0;
+	if (st->left >= 0) {
+		if (len > st->left) len = st->left;
+		st->left -= len;
+	}
+	if (len > 0) httpdSend(connData, data, len);
+	return len;
+}
+
+// Send one record straight out of the ring, returns the number of bytes that went out
+static int ICACHE_FLASH_ATTR
+capSendRecord(HttpdConnData *connData, CapStream *st, bool gap) {
+	CapRecord r;
+	capCopy(st->off, &r, sizeof(CapRecord), false);
+
+	uint8_t hdr[12];
+	int hl = capRecordHeader(st, &r, gap, hdr);
+	int sent = capSend(connData, st, (char *)hdr, hl);
+
+	// payload, in two pieces if it wraps around the end of the ring
+	int off = (st->off + sizeof(CapRecord)) % CAP_RINGSIZE;
+	int n = CAP_RINGSIZE - off;
+	if (n >= r.len) {
+		sent += capSend(connData, st, (char *)capRing+off, r.len);
+	} else {
+		sent += capSend(connData, st, (char *)capRing+off, n);
+		sent += capSend(connData, st, (char *)capRing, r.len-n);
+	}
+
+	st->lastSys = r.sys_timeStamp;
+	st->started = true;
+	st->off = capNext(st->off, &r);
+	st->seq++;
+	return sent;
+}
+
+// Length of the capture st is about to stream, as long as no records get overwritten meanwhile
+static int ICACHE_FLASH_ATTR
+capLength(CapStream *st) {
+	CapStream s = *st;
+	uint8_t hdr[12];
+	int len = CAP_HDRLEN;
+	for (; s.seq < s.endSeq; s.seq++) {
+		CapRecord r;
+		capCopy(s.off, &r, sizeof(CapRecord), false);
+		len += capRecordHeader(&s, &r, false, hdr) + r.len;
+		s.lastSys = r.sys_timeStamp;
+		s.started = true;
+		s.off = capNext(s.off, &r);
+	}
+	return len;
+}
+
+int ICACHE_FLASH_ATTR
+ajaxEmsCapture(HttpdConnData *connData) {
+	CapStream *st = connData->cgiData;
+
+	if (connData->conn==NULL) {
+		//Connection aborted. Clean up.
+		if (st != NULL) os_free(st);
+		return HTTPD_CGI_DONE;
+	}
+
+	if (st == NULL) {
+		//First call, find the first record to send and send the file header
+		char buff[40], etag[40];
+		uint32_t since = 0, time = 0, end = capNextSeq;
+		if (httpdGetArg(connData, "since", buff, sizeof(buff)) > 0)
+			since = atoi(buff);
+		if (httpdGetArg(connData, "time", buff, sizeof(buff)) > 0)
+			time = atoi(buff);
+		if (httpdGetArg(connData, "end", buff, sizeof(buff)) > 0 && atoi(buff) < end)
+			end = atoi(buff);
+
+		st = (CapStream *)os_zalloc(sizeof(CapStream));
+		if (st == NULL) {
+			httpdStartResponse(connData, 500);
+			httpdEndHeaders(connData);
+			return HTTPD_CGI_DONE;
+		}
+		st->seq = capFirstSeq;
+		st->off = capHead;
+		st->endSeq = end;
+		st->left = -1;
+		while (st->seq < st->endSeq) {
+			CapRecord r;
+			capCopy(st->off, &r, sizeof(CapRecord), false);
+			if (st->seq >= since && r.sntp_timeStamp >= time) break;
+			st->off = capNext(st->off, &r);
+			st->seq++;
+		}
+		if (st->endSeq < st->seq) st->endSeq = st->seq;
+
+		// the same records make the same bytes, so they can be served in ranges
+		int len = capLength(st), start, last;
+		if (capBoot == 0) capBoot = os_random() | 1;
+		os_sprintf(etag, "\"cap-%08lx-%lu-%lu\"", (unsigned long)capBoot,
+				(unsigned long)st->seq, (unsigned long)st->endSeq);
+		int range = httpdGetRange(connData, len, etag, &start, &last);
+		if (range < 0) {
+			os_free(st);
+			httpdStartResponse(connData, 416);
+			os_sprintf(buff, "bytes */%d", len);
+			httpdHeader(connData, "Content-Range", buff);
+			httpdEndHeaders(connData);
+			return HTTPD_CGI_DONE;
+		}
+		connData->cgiData = st;
+
+		httpdStartResponse(connData, range > 0 ? 206 : 200);
+		httpdHeader(connData, "Cache-Control", "no-cache, no-store, must-revalidate");
+		httpdHeader(connData, "Content-Type", "application/octet-stream");
+		httpdHeader(connData, "Content-Disposition", "attachment; filename=\"ems.cap\"");
+		httpdHeader(connData, "ETag", etag);
+		httpdHeader(connData, "Accept-Ranges", "bytes");
+		if (range > 0) {
+			os_sprintf(buff, "bytes %d-%d/%d", start, last, len);
+			httpdHeader(connData, "Content-Range", buff);
+			st->skip = start;
+			st->left = last-start+1;
+		}
+		httpdEndHeaders(connData);
+
+		uint8_t hdr[CAP_HDRLEN] = { 'E', 'M', 'S', 'C', CAP_VERSION, sizeof(hdr), 0, 0 };
+		os_memcpy(hdr+8, &st->seq, 4);
+		os_memcpy(hdr+12, &st->endSeq, 4);
+		os_memcpy(hdr+16, &capBoot, 4);
+		capSend(connData, st, (char *)hdr, sizeof(hdr));
+		return HTTPD_CGI_MORE;
+	}
+
+	int sent = 0;
+	while (st->seq < st->endSeq && st->left != 0 && sent < CAP_CHUNK) {
+		bool gap = false;
+		if (st->seq < capFirstSeq) {
+			// the ring wrapped while we were sending, skip what got overwritten; a range has
+			// to be the bytes that were announced, so that one gets aborted instead
+			if (st->left >= 0) {
+				os_free(st);
+				connData->cgiData = NULL;
+				return HTTPD_CGI_ABORT;
+			}
+			st->seq = capFirstSeq;
+			st->off = capHead;
+			gap = true;
+			if (st->seq >= st->endSeq) break;
+		}
+		sent += capSendRecord(connData, st, gap);
+	}
+
+	if (st->seq >= st->endSeq || st->left == 0) {
+		os_free(st);
+		connData->cgiData = NULL;
+		return HTTPD_CGI_DONE;
+	}
+	return HTTPD_CGI_MORE;
+}
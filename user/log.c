@@ -5,6 +5,7 @@
 #include "cgi.h"
 #include "config.h"
 #include "log.h"
+#include "rtclog.h"
 
 // Web log for the esp8266 to replace outputting to uart1.
 // The web log has a 1KB circular in-memory buffer which os_printf prints into and
@@ -81,49 +82,116 @@ log_write_char(char c) {
 	// Store in log buffer
 	if (c == '\n') log_write('\r');
 	log_write(c);
+	// Mirror into RTC memory so it survives a crash
+	rtclogChar(c);
 }
 
+// Append char c to buff at position len using JSON string escaping, returns the new length
+static int ICACHE_FLASH_ATTR
+log_json_char(char *buff, int len, uint8_t c) {
+	if (c == '\\' || c == '"') {
+		buff[len++] = '\\';
+		buff[len++] = c;
+	} else if (c < ' ') {
+		len += os_sprintf(buff+len, "\\u%04x", c);
+	} else {
+		buff[len++] = c;
+	}
+	return len;
+}
+
+// Send the log from before the last reset, which is kept in RTC memory. The text is too big
+// for the callback stack, so it's formatted into the tail of the send buffer and escaped from
+// there into the front of it.
+#define PREV_HDR 48 // room for the JSON before the text
+static int ICACHE_FLASH_ATTR
+ajaxLogPrev(HttpdConnData *connData) {
+	char *buff = httpdSendPtr(connData);
+	int free = httpdSendFree(connData) - 2; // leave room for the closing "}
+	int text_max = free/3;
+	char *text = buff + free - text_max;
+	int text_len = rtclogPrevText(text, text_max);
+
+	// stop before the escaped text would catch up with the chars still to be read
+	int len = PREV_HDR, i;
+	for (i=0; i<text_len && len+7 <= text-buff+i+1; i++)
+		len = log_json_char(buff, len, text[i]);
+
+	char hdr[PREV_HDR];
+	int hdr_len = os_sprintf(hdr, "{\"len\":%d, \"start\":0, \"text\": \"", i);
+	os_memmove(buff+hdr_len, buff+PREV_HDR, len-PREV_HDR);
+	os_memcpy(buff, hdr, hdr_len);
+	len -= PREV_HDR-hdr_len;
+	os_memcpy(buff+len, "\"}", 2);
+	httpdSendCommit(connData, len+2);
+	return HTTPD_CGI_DONE;
+}
+
+// The log text is streamed straight out of log_buf across HTTPD_CGI_MORE calls. Between calls
+// cgiData holds the number of chars sent (high half) and left to send (low half), cgiPrivData
+// the position the text started at. "len" comes last, it's the number of chars that actually
+// went out: if the writer laps the chars not sent yet, the text ends where it got to.
 int ICACHE_FLASH_ATTR
 ajaxLog(HttpdConnData *connData) {
-	char buff[2048];
+	char buff[256];
+	uint32_t *state = (uint32_t *)&connData->cgiData;
 	int len; // length of text in buff
-	int log_len = (log_wr+BUF_MAX-log_rd) % BUF_MAX; // num chars in log_buf
-	int start = 0; // offset onto log_wr to start sending out chars
+	int rd, left, sent = 0;
 
 	if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
-	jsonHeader(connData, 200);
 
-	// figure out where to start in buffer based on URI param
-	len = httpdFindArg(connData->getArgs, "start", buff, sizeof(buff));
-	if (len > 0) {
-		start = atoi(buff);
-		if (start < log_pos) {
-			start = 0;
-		} else if (start >= log_pos+log_len) {
-			start = log_len;
-		} else {
-			start = start - log_pos;
+	int log_len = (log_wr+BUF_MAX-log_rd) % BUF_MAX; // num chars in log_buf
+	if (*state == 0) {
+		int start = 0; // offset onto log_wr to start sending out chars
+		jsonHeader(connData, 200);
+
+		// the pre-reset log from RTC memory is requested using crash=1
+		if (httpdGetArg(connData, "crash", buff, sizeof(buff)) > 0)
+			return ajaxLogPrev(connData);
+
+		// figure out where to start in buffer based on URI param
+		len = httpdGetArg(connData, "start", buff, sizeof(buff));
+		if (len > 0) {
+			start = atoi(buff);
+			if (start < log_pos) {
+				start = 0;
+			} else if (start >= log_pos+log_len) {
+				start = log_len;
+			} else {
+				start = start - log_pos;
+			}
 		}
+
+		// start outputting
+		len = os_sprintf(buff, "{\"start\":%d, \"text\": \"", log_pos+start);
+		httpdSend(connData, buff, len);
+		connData->cgiPrivData = (void *)(log_pos+start);
+		rd = (log_rd+start) % BUF_MAX;
+		left = log_len-start;
+	} else {
+		int pos = (int)connData->cgiPrivData;
+		sent = *state >> 16;
+		left = *state & 0xffff;
+		pos += sent;
+		if (pos < log_pos || pos+left > log_pos+log_len) left = 0; // overwritten
+		rd = (log_rd+pos-log_pos) % BUF_MAX;
 	}
 
-	// start outputting
-	len = os_sprintf(buff, "{\"len\":%d, \"start\":%d, \"text\": \"",
-			log_len-start, log_pos+start);
-
-	int rd = (log_rd+start) % BUF_MAX;
-	while (len < 2040 && rd != log_wr) {
-		uint8_t c = log_buf[rd];
-		if (c == '\\' || c == '"') {
-			buff[len++] = '\\';
-			buff[len++] = c;
-		} else if (c < ' ') {
-			len += os_sprintf(buff+len, "\\u%04x", c);
-		} else {
-			buff[len++] = c;
+	while (left > 0 && httpdSendFree(connData) >= (int)sizeof(buff)) {
+		len = 0;
+		while (left > 0 && len < (int)sizeof(buff)-8) {
+			len = log_json_char(buff, len, log_buf[rd]);
+			rd = (rd + 1) % BUF_MAX;
+			left--;
+			sent++;
 		}
-		rd = (rd + 1) % BUF_MAX;
+		httpdSend(connData, buff, len);
+	}
+	if (left > 0) {
+		*state = (sent << 16) | left;
+		return HTTPD_CGI_MORE;
 	}
-	os_strcpy(buff+len, "\"}"); len+=2;
+	len = os_sprintf(buff, "\", \"len\":%d}", sent);
 	httpdSend(connData, buff, len);
 	return HTTPD_CGI_DONE;
 }
@@ -135,7 +203,7 @@ ajaxLogDbg(HttpdConnData *connData) {
 	if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
 	char buff[512];
 	int len, status = 400;
-	len = httpdFindArg(connData->getArgs, "mode", buff, sizeof(buff));
+	len = httpdGetArg(connData, "mode", buff, sizeof(buff));
 	if (len > 0) {
 		int8_t mode = -1;
 		if (os_strcmp(buff, "auto") == 0) mode = LOG_MODE_AUTO;
@@ -161,6 +229,7 @@ void ICACHE_FLASH_ATTR logInit() {
 	log_no_uart = flashConfig.log_mode == LOG_MODE_OFF; // ON unless set to always-off
 	log_wr = 0;
 	log_rd = 0;
+	rtclogInit(); // pick up the pre-reset log before anything new gets printed
   os_install_putc1((void *)log_write_char);
 }
 
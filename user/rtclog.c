@@ -0,0 +1,187 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <esp8266.h>
+#include "rtclog.h"
+
+// Crash-surviving log: the tail of the debug log plus the headers of the last few EMS
+// telegrams are mirrored into RTC user memory, which survives watchdog and exception resets
+// (but not a power cycle). At boot the previous contents are validated by magic and checksum
+// and, if good, kept in RAM so /log/text?crash=1 can show what happened before the reset.
+// No flash writes are involved, so this costs nothing in terms of flash wear.
+
+// hack: this from LwIP
+extern uint16_t inet_chksum(void *dataptr, uint16_t len);
+
+#define RTCLOG_BLOCK  64          // first RTC user memory block (4 bytes per block)
+#define RTCLOG_MAGIC  0x474c5452  // "RTLG"
+#define RTCLOG_TEXT   320         // chars of log text kept
+#define RTCLOG_TELE   8           // telegram headers kept
+#define RTCLOG_DELAY  1000        // ms telegram headers may wait to be written to RTC memory
+
+typedef struct {
+	uint32_t timeStamp;           // sntp time stamp of the telegram
+	uint8_t  src, dst, type, len; // EMS header bytes and telegram length
+} RtcTelegram;
+
+// Invariants (see console.c for the text ring):
+// - text_wr is the next char to write, text_len the number of valid chars before it
+// - tele_wr is the next telegram slot to write, tele_cnt the number of valid slots
+typedef struct {
+	uint32_t    magic;
+	uint16_t    chksum;
+	uint16_t    text_wr;
+	uint16_t    text_len;
+	uint8_t     tele_wr;
+	uint8_t     tele_cnt;
+	RtcTelegram tele[RTCLOG_TELE];
+	char        text[RTCLOG_TEXT];
+} RtcLog;
+
+static RtcLog rtclog;             // RAM mirror of the RTC copy
+static RtcLog *rtclog_prev;       // contents from before the last reset, NULL if none
+static uint32_t rtclog_reason;    // reset reason that ended the previous run
+static int dirty_lo, dirty_hi;    // byte range of rtclog that needs to be written to RTC
+static ETSTimer flushTimer;       // writes out telegram headers not flushed with the text
+static bool flushArmed;
+
+static uint16_t ICACHE_FLASH_ATTR
+rtclogChksum(RtcLog *log) {
+	uint16_t saved = log->chksum;
+	log->chksum = 0;
+	uint16_t chksum = inet_chksum(log, sizeof(RtcLog));
+	log->chksum = saved;
+	return chksum;
+}
+
+static void ICACHE_FLASH_ATTR
+rtclogDirty(void *start, int len) {
+	int lo = (char *)start - (char *)&rtclog;
+	if (lo < dirty_lo) dirty_lo = lo;
+	if (lo+len > dirty_hi) dirty_hi = lo+len;
+}
+
+// Write the header and the dirty part of the mirror to RTC memory. RTC memory can only be
+// written in whole 4-byte blocks, so the dirty range is widened to block boundaries.
+static void ICACHE_FLASH_ATTR
+rtclogFlush(void) {
+	rtclog.chksum = rtclogChksum(&rtclog);
+	system_rtc_mem_write(RTCLOG_BLOCK, &rtclog, offsetof(RtcLog, tele));
+	if (dirty_hi > dirty_lo) {
+		int lo = dirty_lo & ~3;
+		int hi = (dirty_hi + 3) & ~3;
+		system_rtc_mem_write(RTCLOG_BLOCK + lo/4, (char *)&rtclog + lo, hi-lo);
+	}
+	dirty_lo = sizeof(RtcLog);
+	dirty_hi = 0;
+}
+
+// Append a character to the RTC text ring, the ring is flushed at the end of each line
+void ICACHE_FLASH_ATTR
+rtclogChar(char c) {
+	if (c == '\r') return;
+	rtclog.text[rtclog.text_wr] = c;
+	rtclogDirty(&rtclog.text[rtclog.text_wr], 1);
+	rtclog.text_wr = (rtclog.text_wr+1) % RTCLOG_TEXT;
+	if (rtclog.text_len < RTCLOG_TEXT) rtclog.text_len++;
+	if (c == '\n') rtclogFlush();
+}
+
+static void ICACHE_FLASH_ATTR
+rtclogTimerCb(void *arg) {
+	flushArmed = false;
+	if (dirty_hi > dirty_lo) rtclogFlush();
+}
+
+// Record the header of an EMS telegram, buf points to the raw telegram bytes. Polls and echoes
+// (single bytes) are left out, the bus is full of them and they'd push out the telegrams that
+// tell something. The headers get written to RTC memory with the next log line or within
+// RTCLOG_DELAY, not for every telegram.
+void ICACHE_FLASH_ATTR
+rtclogTelegram(uint32_t timeStamp, const char *buf, int len) {
+	if (len <= 1) return;
+	RtcTelegram *t = &rtclog.tele[rtclog.tele_wr];
+	t->timeStamp = timeStamp;
+	t->src  = len > 0 ? buf[0] : 0;
+	t->dst  = len > 1 ? buf[1] : 0;
+	t->type = len > 2 ? buf[2] : 0;
+	t->len  = len > 255 ? 255 : len;
+	rtclogDirty(t, sizeof(RtcTelegram));
+	rtclog.tele_wr = (rtclog.tele_wr+1) % RTCLOG_TELE;
+	if (rtclog.tele_cnt < RTCLOG_TELE) rtclog.tele_cnt++;
+	if (!flushArmed) {
+		flushArmed = true;
+		os_timer_arm(&flushTimer, RTCLOG_DELAY, 0);
+	}
+}
+
+static char *rst_codes[] = {
+	"normal", "wdt reset", "exception", "soft wdt", "restart", "deep sleep", "???",
+};
+
+// Format the log from before the last reset into buff as plain text. Returns the length
+// or -1 if there is no valid previous log.
+int ICACHE_FLASH_ATTR
+rtclogPrevText(char *buff, int buffLen) {
+	RtcLog *p = rtclog_prev;
+	if (p == NULL || buffLen < 128) return -1;
+	int len = os_sprintf(buff, "--- before reset (%s) ---\n",
+			rst_codes[rtclog_reason < 6 ? rtclog_reason : 6]);
+
+	// last telegram headers, oldest first
+	for (int i=0; i<p->tele_cnt && len < buffLen-48; i++) {
+		RtcTelegram *t = &p->tele[(p->tele_wr+RTCLOG_TELE-p->tele_cnt+i) % RTCLOG_TELE];
+		len += os_sprintf(buff+len, "%02d:%02d:%02d <%d> %02x %02x %02x\n",
+				(int)(t->timeStamp % 86400) / 3600, (int)(t->timeStamp % 3600) / 60,
+				(int)(t->timeStamp % 60), t->len, t->src, t->dst, t->type);
+	}
+
+	// last log lines, oldest first
+	int rd = (p->text_wr+RTCLOG_TEXT-p->text_len) % RTCLOG_TEXT;
+	for (int i=0; i<p->text_len && len < buffLen-1; i++) {
+		buff[len++] = p->text[rd];
+		rd = (rd+1) % RTCLOG_TEXT;
+	}
+	buff[len] = 0;
+	return len;
+}
+
+// Pick up the RTC log from before the reset, if any, and start a fresh one. Must be called
+// before anything is printed to the log.
+void ICACHE_FLASH_ATTR
+rtclogInit(void) {
+	struct rst_info *rst_info = system_get_rst_info();
+	rtclog_reason = rst_info->reason;
+
+	system_rtc_mem_read(RTCLOG_BLOCK, &rtclog, sizeof(RtcLog));
+	if (rtclog.magic == RTCLOG_MAGIC && rtclog.chksum == rtclogChksum(&rtclog) &&
+			rtclog.text_wr < RTCLOG_TEXT && rtclog.text_len <= RTCLOG_TEXT &&
+			rtclog.tele_wr < RTCLOG_TELE && rtclog.tele_cnt <= RTCLOG_TELE) {
+		rtclog_prev = (RtcLog *)os_malloc(sizeof(RtcLog));
+		if (rtclog_prev != NULL) os_memcpy(rtclog_prev, &rtclog, sizeof(RtcLog));
+	}
+
+	os_memset(&rtclog, 0, sizeof(RtcLog));
+	rtclog.magic = RTCLOG_MAGIC;
+	dirty_lo = 0;
+	dirty_hi = sizeof(RtcLog);
+	rtclogFlush();
+
+	os_timer_disarm(&flushTimer);
+	os_timer_setfn(&flushTimer, rtclogTimerCb, NULL);
+}
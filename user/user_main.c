@@ -29,6 +29,7 @@
 #include "log.h"
 #include "sntp.h"
 #include "ems.h"
+#include "emscapture.h"
 #include <gpio.h>
 
 //#define SHOW_HEAP_USE
@@ -64,9 +65,15 @@ should be placed above the URLs they protect.
 HttpdBuiltInUrl builtInUrls[]={
 	{"/", cgiRedirect, "/home.html"},
 	{"/menu", cgiMenu, NULL},
+	{"/stats", cgiStats, NULL},
 	{"/flash/next", cgiGetFirmwareNext, NULL},
 	{"/flash/upload", cgiUploadFirmware, NULL},
 	{"/flash/reboot", cgiRebootFirmware, NULL},
+#ifdef ESPFS_PARTITION
+	{"/flash/espfs", cgiUploadEspFs, NULL},
+#endif
+	{"/ems/state", ajaxEmsState, NULL},
+	{"/ems/capture", ajaxEmsCapture, NULL},
 	{"/log/text", ajaxLog, NULL},
 	{"/log/dbg", ajaxLogDbg, NULL},
 	{"/console/reset", ajaxConsoleReset, NULL},
@@ -134,10 +141,14 @@ void user_init(void) {
 	os_printf("Flash config restore %s\n", restoreOk ? "ok" : "*FAILED*");
 	statusInit();		// Status LEDs
 	wifiInit();			// Wifi
+#ifdef ESPFS_PARTITION
+	if (!espFsMountPartition())	// web pages uploaded to /flash/espfs take precedence
+#endif
 	espFsInit(&_binary_espfs_img_start);	// init the flash filesystem with the html stuff
 	httpdInit(builtInUrls, 80);	// mount the http handlers
 	serbridgeInit(23);	// init the wifi-serial transparent bridge (port 23)
 	uart_add_recv_cb(&serbridgeUartCb);
+	uart_add_recv_cb(&emsUartCb);	// capture telegrams and decode EMS state
 
 #ifdef SHOW_HEAP_USE
 	os_timer_disarm(&prHeapTimer);